@@ -15,7 +15,8 @@ class PacketType(Enum):
     ADMIN_PACKET = 0xCC
 
 
-class MsgType(Enum):
+# The data of a CONN_PACKET (and of an ADMIN_PACKET), as in ConnMsg.
+class ConnMsg(Enum):
     USERNAME_REQUEST = 0
     NUM_OF_GAMES = 1
     REBOOT_SERVER = 2
@@ -25,6 +26,16 @@ class MsgType(Enum):
     PLAYER2_INDICATION = 6
     START_SERVER = 7
     SHUTDOWN_SERVER = 8
+    MULTIPLEX_REQUEST = 9
+    SESSION_OPEN = 10
+    SESSION_CLOSE = 11
+    CHALLENGE_REQUEST = 12
+    USERNAME_TAKEN = 13
+
+
+# The data of a DATA_PACKET that ends the game, as in GameResult. Any other
+# DATA_PACKET carries a move.
+class GameResult(Enum):
     DRAW_MATCH = 11
     O_WINS = 12
     X_WINS = 13
@@ -40,18 +51,24 @@ def decodePacket(rawData: bytes):
 
 
 class Client:
-    def __init__(self, userName: str) -> None:
+    def __init__(self, userName: str, challenge: str = "") -> None:
         self.socket_ = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         self.socket_.connect((HOST, PORT))
         self.userName_ = userName
+        # Only play against the player of this name, if set.
+        self.challenge_ = challenge
         self.board_ = [['-', '-', '-'], ['-', '-', '-'], ['-', '-', '-']]
         self.playerIdentifier_ = 'X'
         self.opponentIdentifier_ = 'O'
         self.gameOver_ = False
 
     def sendUsername(self):
-        msg = self.userName_ + '\n'
-        self.socket_.send(msg.encode('utf-8'))
+        msg = self.userName_.encode('utf-8')
+        if self.challenge_:
+            msg += createPacket(PacketType.CONN_PACKET.value,
+                                ConnMsg.CHALLENGE_REQUEST.value)
+            msg += self.challenge_.encode('utf-8')
+        self.socket_.send(msg + b'\n')
         print("Sent username to server")
 
     def displayBoard(self):
@@ -115,30 +132,33 @@ class Client:
         # if not dontUpdate:
         self.updateBoard(move, self.playerIdentifier_)
 
-    def endGame(self, result: MsgType):
+    def endGame(self, result: GameResult):
         pass
 
     def processResult(self, result):
-        if (result == MsgType.DRAW_MATCH.value):
+        if (result == GameResult.DRAW_MATCH.value):
             print("Draw match!!")
 
     def handleIncomingMsg(self, rawData: bytes):
         [msgType, data] = decodePacket(rawData)
         #print("RECVD MSG FROM SERVER: MsgType: ", msgType, " data: ", data)
         if (msgType == PacketType.CONN_PACKET.value):
-            if (data == MsgType.USERNAME_REQUEST.value):
+            if (data == ConnMsg.USERNAME_REQUEST.value):
                 self.sendUsername()
-            elif (data == MsgType.PLAYER1_INDICATION.value):
+            elif (data == ConnMsg.PLAYER1_INDICATION.value):
                 print("You are X!")
                 self.opponentIdentifier_ = 'O'
                 self.sendResponse()
-            elif (data == MsgType.PLAYER2_INDICATION.value):
+            elif (data == ConnMsg.PLAYER2_INDICATION.value):
                 self.playerIdentifier_ = 'O'
                 self.opponentIdentifier_ = 'X'
                 print("You are O!")
+            elif (data == ConnMsg.USERNAME_TAKEN.value):
+                print("Someone is already playing as", self.userName_)
+                self.gameOver_ = True
 
         elif (msgType == PacketType.DATA_PACKET.value):
-            if (data == MsgType.X_WINS.value):
+            if (data == GameResult.X_WINS.value):
                 if (self.playerIdentifier_ == 'X'):
                     print("You won!!")
                 else:
@@ -147,10 +167,10 @@ class Client:
                     print("You lost :(")
                 self.gameOver_ = True
                 return
-            elif (data == MsgType.DRAW_MATCH.value):
+            elif (data == GameResult.DRAW_MATCH.value):
                 print("Draw match!!")
                 self.gameOver_ = True
-            elif (data == MsgType.O_WINS.value):
+            elif (data == GameResult.O_WINS.value):
                 if (self.playerIdentifier_ == 'O'):
                     print("You won!!")
                 else:
@@ -174,8 +194,8 @@ class Admin:
 
     def startServer(self):
         self.socket_.send(createPacket(
-            PacketType.ADMIN_PACKET, MsgType.START_SERVER))
+            PacketType.ADMIN_PACKET, ConnMsg.START_SERVER))
 
     def shutDownServer(self):
         self.socket_.send(createPacket(
-            PacketType.ADMIN_PACKET, MsgType.SHUTDOWN_SERVER))
+            PacketType.ADMIN_PACKET, ConnMsg.SHUTDOWN_SERVER))
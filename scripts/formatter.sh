@@ -4,12 +4,37 @@
 cd $(git rev-parse --show-toplevel)
 
 # C++ formatting
-clang-format --style=file -i src/engine/game/Game.cpp \
+clang-format --style=file -i src/bench/Bench.cpp \
+                             src/bench/include/Bench.hpp \
+                             src/capture/include/Capture.hpp \
+                             src/capture/Capture.cpp \
+                             src/capture/Reader.cpp \
+                             src/engine/game/include/Datagram.hpp \
+                             src/engine/game/Datagram.cpp \
+                             src/engine/game/include/Directory.hpp \
+                             src/engine/game/Directory.cpp \
+                             src/engine/game/Game.cpp \
                              src/engine/game/include/Game.hpp \
+                             src/engine/game/include/Multiplexer.hpp \
+                             src/engine/game/Multiplexer.cpp \
+                             src/engine/handoff/include/Handoff.hpp \
+                             src/engine/handoff/Handoff.cpp \
                              src/engine/include/Server.hpp \
                              src/engine/Server.cpp \
+                             src/engine/tls/include/Tls.hpp \
+                             src/engine/tls/Tls.cpp \
                              src/logger/include/Logger.hpp \
                              src/logger/Logger.cpp \
+                             src/logtool/include/LogTool.hpp \
+                             src/logtool/LogTool.cpp \
+                             src/logtool/main.cpp \
+                             src/ratelimit/include/RateLimit.hpp \
+                             src/ratelimit/RateLimit.cpp \
+                             src/replay/include/Replay.hpp \
+                             src/replay/Replay.cpp \
+                             src/replay/main.cpp \
+                             src/tracer/include/Tracer.hpp \
+                             src/tracer/Tracer.cpp \
                              src/main.cpp
 
 # Python formatting
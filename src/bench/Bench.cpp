@@ -0,0 +1,952 @@
+#include "Bench.hpp"
+#include "Server.hpp"
+
+#include <poll.h>
+
+namespace
+{
+    struct Options
+    {
+            uint32_t warmup_      = 2;
+            uint32_t repetitions_ = 10;
+            uint32_t threads_     = std::max(2u, thread::hardware_concurrency());
+            string   output_;
+            string   filter_;
+    };
+
+    void usage()
+    {
+        std::cerr << "Usage: bench [--warmup N] [--reps N] [--threads N] "
+                     "[--filter GROUP] [--out FILE]\n"
+                     "GROUP is part of game, packet, containers, tracer, "
+                     "capture, ratelimit,\ndirectory, logger or server.\n";
+    }
+
+    bool parseArgs(int argc, char *argv[], Options &options)
+    {
+        for (int i = 1; i < argc; i += 2)
+        {
+            string arg = argv[i];
+            if (i + 1 == argc) return false;
+            try
+            {
+                if (arg == "--warmup")
+                    options.warmup_ = std::stoul(argv[i + 1]);
+                else if (arg == "--reps")
+                    options.repetitions_ = std::stoul(argv[i + 1]);
+                else if (arg == "--threads")
+                    options.threads_ =
+                        std::max(1ul, std::stoul(argv[i + 1]));
+                else if (arg == "--out")
+                    options.output_ = argv[i + 1];
+                else if (arg == "--filter")
+                    options.filter_ = argv[i + 1];
+                else
+                    return false;
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A full game played out move by move: X takes the left column.
+    constexpr array<uint8_t, 5> WINNING_GAME = {Move::ONE, Move::TWO,
+                                                Move::FOUR, Move::FIVE,
+                                                Move::SEVEN};
+
+    void benchGame(Bench::Runner &runner, asio::io_service &service)
+    {
+        auto  player1 = std::make_shared<PlayerHandler>(service);
+        auto  player2 = std::make_shared<PlayerHandler>(service);
+        Game  game(player1, player2);
+        const uint64_t iterations = 1 << 20;
+
+        runner.run("game.updateBoard", iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                game.updateBoard(static_cast<PlayerIdentifer>(i & 1),
+                                 static_cast<uint8_t>(i % 9 + 1));
+            }
+        });
+
+        runner.run("game.checkResult.empty", iterations, [&](uint64_t n) {
+            game.resetBoard();
+            for (uint64_t i = 0; i < n; ++i)
+                Bench::doNotOptimize(game.checkResult());
+        });
+
+        runner.run("game.updateBoard+checkResult", iterations,
+                   [&](uint64_t n) {
+                       for (uint64_t i = 0; i < n; ++i)
+                       {
+                           auto step = i % WINNING_GAME.size();
+                           if (step == 0) game.resetBoard();
+                           game.updateBoard(
+                               static_cast<PlayerIdentifer>(step & 1),
+                               WINNING_GAME[step]);
+                           Bench::doNotOptimize(game.checkResult());
+                       }
+                   });
+    }
+
+    void benchPacket(Bench::Runner &runner)
+    {
+        const uint64_t  iterations = 1 << 22;
+        vector<uint8_t> buffer(sizeof(Packet));
+
+        // Mirrors PlayerHandler::sendMsg/getMove without a socket.
+        runner.run("packet.encode", iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                auto packet = Packet::create(PacketType::DATA_PACKET,
+                                             static_cast<uint8_t>(i % 9 + 1));
+                buffer[0]   = packet.type_;
+                buffer[1]   = packet.data_;
+                Bench::doNotOptimize(buffer.data());
+            }
+        });
+
+        runner.run("packet.decode", iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                buffer[1] = static_cast<uint8_t>(i);
+                Packet packet;
+                packet.type_ = buffer[0];
+                packet.data_ = buffer[1];
+                Bench::doNotOptimize(packet);
+            }
+        });
+
+        runner.run("packet.to_string", iterations / 16, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                auto type = (i & 1) ? PacketType::DATA_PACKET
+                                    : PacketType::CONN_PACKET;
+                Bench::doNotOptimize(to_string(
+                    Packet::create(type, static_cast<uint8_t>(i % 10))));
+            }
+        });
+    }
+
+    void benchContainers(Bench::Runner &runner, asio::io_service &service,
+                         uint32_t threads)
+    {
+        const uint64_t iterations = 1 << 16;
+        auto           handler    = std::make_shared<PlayerHandler>(service);
+
+        for (uint32_t count : {1u, threads})
+        {
+            string suffix = ".threads=" + std::to_string(count);
+
+            // Worker 0 also plays the client processor, which adopts what
+            // was inserted and removes it.
+            TS_List<PlayerHandler> list;
+            runner.runThreaded(
+                "ts_list.insert+adopt" + suffix, count, iterations,
+                [&](uint32_t worker, uint64_t n) {
+                    for (uint64_t i = 0; i < n; ++i)
+                    {
+                        list.insert(handler);
+                        if (worker != 0 || i % 64 != 63) continue;
+                        list.adopt();
+                        for (auto it = list.begin(); it != list.end();)
+                            it = list.remove(it);
+                    }
+                });
+
+            // Every thread pushes before it pops, so the queue never runs dry.
+            TS_Queue queue;
+            runner.runThreaded("ts_queue.insert+pop" + suffix, count,
+                               iterations, [&](uint32_t, uint64_t n) {
+                                   for (uint64_t i = 0; i < n; ++i)
+                                   {
+                                       queue.insert(handler);
+                                       Bench::doNotOptimize(queue.pop());
+                                   }
+                               });
+        }
+    }
+
+    void benchTracer(Bench::Runner &runner)
+    {
+        const uint64_t iterations = 1 << 20;
+
+        // One move's worth of instrumentation, as done by Game.
+        auto traceMove = [](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                auto id = Tracing::beginMove();
+                Tracing::record(id, Tracing::READ_COMPLETE);
+                Tracing::record(id, Tracing::HANDLER_DISPATCH);
+                Tracing::record(id, Tracing::BOARD_UPDATE);
+                Tracing::record(id, Tracing::SEND_ISSUED);
+                Tracing::record(id, Tracing::SEND_COMPLETE);
+            }
+        };
+
+        runner.run("tracer.move.disabled", iterations, traceMove);
+        Tracing::enable(100, "");
+        runner.run("tracer.move.sample=100", iterations, traceMove);
+        Tracing::disable();
+    }
+
+    void benchCapture(Bench::Runner &runner, uint32_t threads)
+    {
+        const uint64_t iterations = 1 << 20;
+
+        // One move's worth of capture points, as done by Game: the move read
+        // from the player and the packet sent back.
+        uint8_t  move[]      = {PacketType::DATA_PACKET, Move::FIVE};
+        uint32_t session     = 0;
+        auto     captureMove = [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+            {
+                // Reloaded every time, like PlayerHandler's captureId_.
+                Bench::doNotOptimize(session);
+                if (session == 0) continue;
+                Capture::record(session, Capture::IN, move, sizeof(move));
+                Capture::record(session, Capture::OUT, move, sizeof(move));
+            }
+        };
+
+        runner.run("capture.move.disabled", iterations, captureMove);
+        if (!Capture::start("/dev/null")) return;
+        session = Capture::open("bench");
+        runner.run("capture.move", iterations, captureMove);
+
+        // Worker threads recording their own sessions at once.
+        for (uint32_t count : {1u, threads})
+        {
+            runner.runThreaded(
+                "capture.move.threads=" + std::to_string(count), count,
+                iterations, [&](uint32_t worker, uint64_t n) {
+                    uint32_t own = session + worker;
+                    for (uint64_t i = 0; i < n; ++i)
+                    {
+                        Capture::record(own, Capture::IN, move, sizeof(move));
+                        Capture::record(own, Capture::OUT, move, sizeof(move));
+                    }
+                });
+        }
+        Capture::stop();
+    }
+
+    void benchRateLimit(Bench::Runner &runner, uint32_t threads)
+    {
+        const uint64_t   iterations = 1 << 20;
+        RateLimit::Limit unlimited  = RateLimit::perSecond(1e12);
+
+        RateLimit::TokenBucket bucket;
+        runner.run("ratelimit.bucket.consume", iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                Bench::doNotOptimize(bucket.consume(unlimited));
+        });
+
+        // Every thread cycles through its own 256 source addresses.
+        for (uint32_t count : {1u, threads})
+        {
+            RateLimit::Table table;
+            runner.runThreaded(
+                "ratelimit.table.allow.threads=" + std::to_string(count),
+                count, iterations, [&](uint32_t worker, uint64_t n) {
+                    for (uint64_t i = 0; i < n; ++i)
+                    {
+                        asio::ip::address_v4 source((worker << 8) | (i & 255));
+                        Bench::doNotOptimize(table.allow(source, unlimited));
+                    }
+                });
+
+            // A flood of invalid packets, as counted by every worker.
+            runner.runThreaded(
+                "ratelimit.recordDrop.threads=" + std::to_string(count), count,
+                iterations, [&](uint32_t worker, uint64_t n) {
+                    asio::ip::address_v4 source(worker);
+                    for (uint64_t i = 0; i < n; ++i)
+                        RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                              source);
+                });
+        }
+    }
+
+    void benchDirectory(Bench::Runner &runner, asio::io_service &service,
+                        uint32_t threads)
+    {
+        const uint64_t    iterations = 1 << 18;
+        const std::size_t online     = 100000;
+
+        auto player = [&](const string &name) {
+            return std::make_shared<PlayerHandler>(service, nullptr, 0, name);
+        };
+
+        PlayerDirectory                        directory;
+        vector<string>                         names;
+        vector<std::shared_ptr<PlayerHandler>> players;
+        for (std::size_t i = 0; i < online; ++i)
+        {
+            names.push_back("player" + std::to_string(i));
+            players.push_back(player(names.back()));
+            directory.add(players.back());
+        }
+
+        for (uint32_t count : {1u, threads})
+        {
+            string suffix = ".online=" + std::to_string(online) +
+                            ".threads=" + std::to_string(count);
+
+            runner.runThreaded(
+                "directory.find" + suffix, count, iterations,
+                [&](uint32_t worker, uint64_t n) {
+                    for (uint64_t i = 0; i < n; ++i)
+                    {
+                        auto &name =
+                            names[(worker * 7919 + i * 104729) % online];
+                        Bench::doNotOptimize(directory.find(name));
+                    }
+                });
+
+            // Every thread lists and unlists its own 256 extra players.
+            vector<vector<std::shared_ptr<PlayerHandler>>> extra(count);
+            for (uint32_t worker = 0; worker < count; ++worker)
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    extra[worker].push_back(
+                        player("extra" + std::to_string(worker) + "." +
+                               std::to_string(i)));
+                }
+            }
+            runner.runThreaded("directory.add+remove" + suffix, count,
+                               iterations, [&](uint32_t worker, uint64_t n) {
+                                   auto &mine = extra[worker];
+                                   for (uint64_t i = 0; i < n; ++i)
+                                   {
+                                       auto &handler = mine[i & 255];
+                                       directory.add(handler);
+                                       directory.remove(*handler);
+                                   }
+                               });
+        }
+    }
+
+    // Blocking client side of a player connection, optionally over TLS.
+    class Client
+    {
+        private:
+            tcp::socket socket_;
+            SSL        *ssl_;
+
+        public:
+            Client(asio::io_service &service) : socket_(service), ssl_(nullptr)
+            {
+            }
+
+            ~Client()
+            {
+                // Without a close_notify OpenSSL marks the session as not
+                // resumable.
+                if (ssl_ == nullptr) return;
+                SSL_shutdown(ssl_);
+                SSL_free(ssl_);
+            }
+
+            // Retries for a while so that callers need not wait for the
+            // server to start listening. With a TLS context, `session` may
+            // be a previous session to resume.
+            bool connect(uint16_t port, SSL_CTX *tls = nullptr,
+                         SSL_SESSION *session = nullptr)
+            {
+                tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+                err           error;
+                for (int attempt = 0; attempt < 200; ++attempt)
+                {
+                    socket_.connect(endpoint, error);
+                    if (!error) break;
+                    socket_.close();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                if (error) return false;
+                socket_.set_option(tcp::no_delay(true));
+                if (tls == nullptr) return true;
+
+                ssl_ = SSL_new(tls);
+                SSL_set_fd(ssl_, socket_.native_handle());
+                if (session != nullptr) SSL_set_session(ssl_, session);
+                return SSL_connect(ssl_) == 1;
+            }
+
+            bool read(uint8_t *data, size_t size)
+            {
+                if (ssl_ == nullptr)
+                {
+                    err error;
+                    return asio::read(socket_, asio::buffer(data, size),
+                                      error) == size;
+                }
+                size_t done = 0;
+                while (done < size)
+                {
+                    int result = SSL_read(ssl_, data + done, size - done);
+                    if (result <= 0) return false;
+                    done += result;
+                }
+                return true;
+            }
+
+            bool write(const void *data, size_t size)
+            {
+                if (ssl_ == nullptr)
+                {
+                    err error;
+                    return asio::write(socket_, asio::buffer(data, size),
+                                       error) == size;
+                }
+                return SSL_write(ssl_, data, size) == static_cast<int>(size);
+            }
+
+            // Caller owns the returned session.
+            SSL_SESSION *session() const
+            {
+                return ssl_ != nullptr ? SSL_get1_session(ssl_) : nullptr;
+            }
+
+            bool resumed() const
+            {
+                return ssl_ != nullptr && SSL_session_reused(ssl_);
+            }
+    };
+
+    // Blocking client side of a datagram session. Every DATA it receives is
+    // acked at once, and its own DATA is resent until acked.
+    class DatagramClient
+    {
+        private:
+            udp::socket                    socket_;
+            udp::endpoint                  server_;
+            uint32_t                       sessionId_;
+            uint16_t                       nextSeq_, expected_;
+            vector<pair<uint16_t, Packet>> unacked_;
+
+            static constexpr auto TIMEOUT = std::chrono::milliseconds(20);
+
+            void sendTo(DatagramHeader header, const void *payload = nullptr,
+                        size_t size = 0)
+            {
+                array<uint8_t, DatagramTransport::MAX_DATAGRAM_SIZE> data;
+                encodeHeader(header, data.data());
+                if (size != 0)
+                    std::memcpy(data.data() + sizeof(header), payload, size);
+                err error;
+                socket_.send_to(asio::buffer(data, sizeof(header) + size),
+                                server_, 0, error);
+            }
+
+            // Waits up to TIMEOUT for a datagram.
+            size_t receive(array<uint8_t, 64> &data)
+            {
+                pollfd poll{socket_.native_handle(), POLLIN, 0};
+                if (::poll(&poll, 1, TIMEOUT.count()) <= 0) return 0;
+                err  error;
+                auto size = socket_.receive(asio::buffer(data), 0, error);
+                return error ? 0 : size;
+            }
+
+        public:
+            DatagramClient(asio::io_service &service)
+                : socket_(service), sessionId_(0), nextSeq_(0), expected_(0)
+            {
+            }
+
+            ~DatagramClient()
+            {
+                if (sessionId_ != 0) sendTo({sessionId_, BYE, 0, expected_});
+            }
+
+            // Says HELLO until WELCOMEd with a session id, for a while, so
+            // that callers need not wait for the server to start. The
+            // cookie of a WELCOME without one goes into the next HELLO.
+            bool connect(uint16_t port, const string &userName)
+            {
+                server_ = udp::endpoint(asio::ip::address_v4::loopback(), port);
+                socket_.open(udp::v4());
+
+                uint64_t nonce = std::random_device()();
+                string   hello(2 * sizeof(nonce), '\0');
+                std::memcpy(hello.data(), &nonce, sizeof(nonce));
+                hello += userName;
+
+                array<uint8_t, 64> data;
+                DatagramHeader     header;
+                for (int attempt = 0; attempt < 100; ++attempt)
+                {
+                    sendTo({0, HELLO, 0, 0}, hello.data(), hello.size());
+                    auto size = receive(data);
+                    if (size < sizeof(header) + 2 * sizeof(nonce)) continue;
+                    header = decodeHeader(data.data());
+                    if (header.kind_ != WELCOME ||
+                        std::memcmp(data.data() + sizeof(header), &nonce,
+                                    sizeof(nonce)) != 0)
+                        continue;
+                    if (header.sessionId_ != 0)
+                    {
+                        sessionId_ = header.sessionId_;
+                        return true;
+                    }
+                    std::memcpy(hello.data() + sizeof(nonce),
+                                data.data() + sizeof(header) + sizeof(nonce),
+                                sizeof(nonce));
+                }
+                return false;
+            }
+
+            // One packet at a time, like the games send them.
+            bool write(const void *data, size_t size)
+            {
+                if (size != sizeof(Packet)) return false;
+                Packet packet;
+                std::memcpy(&packet, data, size);
+                unacked_.push_back({nextSeq_, packet});
+                sendTo({sessionId_, DATA, nextSeq_++, expected_}, &packet,
+                       sizeof(packet));
+                return true;
+            }
+
+            // The next packet in order.
+            bool read(uint8_t *packet, size_t size)
+            {
+                if (size != sizeof(Packet)) return false;
+                array<uint8_t, 64> data;
+                DatagramHeader     header;
+                for (int timeouts = 0; timeouts < 100;)
+                {
+                    auto received = receive(data);
+                    if (received < sizeof(header))
+                    {
+                        ++timeouts;
+                        for (auto &[seq, unacked] : unacked_)
+                        {
+                            sendTo({sessionId_, DATA, seq, expected_},
+                                   &unacked, sizeof(unacked));
+                        }
+                        continue;
+                    }
+                    header = decodeHeader(data.data());
+                    if (header.kind_ == RESET) return false;
+
+                    auto ack = header.ack_;
+                    unacked_.erase(std::remove_if(unacked_.begin(),
+                                                  unacked_.end(),
+                                                  [ack](auto &message) {
+                                                      return seqBefore(
+                                                          message.first, ack);
+                                                  }),
+                                   unacked_.end());
+                    if (header.kind_ != DATA ||
+                        received != sizeof(header) + sizeof(Packet))
+                        continue;
+
+                    bool next = header.seq_ == expected_;
+                    if (next) ++expected_;
+                    sendTo({sessionId_, ACK, 0, expected_});
+                    if (!next) continue;
+                    std::memcpy(packet, data.data() + sizeof(header),
+                                sizeof(Packet));
+                    return true;
+                }
+                return false;
+            }
+    };
+
+    // Plays one scripted game once the player has entered the lobby. For
+    // every move a player sends, records the time until the server relays
+    // the next packet back, i.e. two relays through the server plus the
+    // opponent's reply.
+    template <class Connection>
+    void playGame(Connection &client, vector<double> &samples)
+    {
+        array<uint8_t, sizeof(Packet)> packet;
+        client.read(packet.data(), packet.size()); // PLAYER{1,2}_INDICATION
+
+        // X takes the left column, O plays alongside it and loses.
+        bool            first = packet[1] == ConnMsg::PLAYER1_INDICATION;
+        vector<uint8_t> moves = {Move::TWO, Move::FIVE};
+        if (first) moves = {Move::ONE, Move::FOUR, Move::SEVEN};
+        size_t next    = 0;
+        bool   waiting = false;
+        auto   sentAt  = Bench::Clock::now();
+
+        auto sendMove = [&] {
+            packet = {PacketType::DATA_PACKET, moves[next++]};
+            sentAt = Bench::Clock::now();
+            client.write(packet.data(), packet.size());
+            waiting = true;
+        };
+
+        if (first) sendMove();
+        while (client.read(packet.data(), packet.size()))
+        {
+            if (waiting)
+            {
+                samples.push_back(std::chrono::duration<double, std::nano>(
+                                      Bench::Clock::now() - sentAt)
+                                      .count());
+                waiting = false;
+            }
+            if (packet[1] >= GameResult::DRAW) break;
+            if (next < moves.size()) sendMove();
+        }
+    }
+
+    // Bots must not share a name, since a name can only be online once.
+    std::atomic<uint32_t> nextBot(0);
+
+    string botName()
+    {
+        return "bench" + std::to_string(nextBot.fetch_add(1));
+    }
+
+    // Plays games over TCP connections. With TLS, every connection after
+    // the first resumes the previous session.
+    //
+    // Clients draw connections from a shared, even budget: with a fixed
+    // count per client, a slow client could be left alone in the lobby
+    // once everyone else is done.
+    void playGames(uint16_t port, std::atomic<int32_t> &connections,
+                   vector<double> &samples, SSL_CTX *tls = nullptr)
+    {
+        asio::io_service service;
+        SSL_SESSION     *session = nullptr;
+
+        while (connections.fetch_sub(1) > 0)
+        {
+            Client client(service);
+            if (!client.connect(port, tls, session)) break;
+
+            array<uint8_t, sizeof(Packet)> packet;
+            string                         userName = botName() + "\n";
+            client.read(packet.data(), packet.size()); // USERNAME_REQUEST
+            client.write(userName.data(), userName.size());
+            playGame(client, samples);
+
+            if (tls != nullptr && session == nullptr)
+                session = client.session();
+        }
+        SSL_SESSION_free(session);
+    }
+
+    // The games of playGames, over datagram sessions.
+    void playDatagrams(uint16_t port, std::atomic<int32_t> &connections,
+                       vector<double> &samples)
+    {
+        asio::io_service service;
+        while (connections.fetch_sub(1) > 0)
+        {
+            DatagramClient client(service);
+            if (!client.connect(port, botName())) break;
+            playGame(client, samples);
+        }
+    }
+
+    // The games of playGames, `sessions` at a time over one multiplexed
+    // connection. Sessions draw from the same kind of budget.
+    void playMultiplexed(uint16_t port, uint32_t sessions,
+                         std::atomic<int32_t> &connections,
+                         vector<double>       &samples)
+    {
+        struct Session
+        {
+                vector<uint8_t>          moves_;
+                size_t                   next_    = 0;
+                bool                     waiting_ = false;
+                Bench::Clock::time_point sentAt_;
+        };
+
+        asio::io_service service;
+        Client           client(service);
+        if (!client.connect(port)) return;
+
+        vector<Session> state(sessions);
+        vector<uint8_t> out;
+        uint32_t        active = 0;
+
+        auto push = [&](const Frame &frame) {
+            out.resize(out.size() + sizeof(Frame));
+            encodeFrame(frame, out.data() + out.size() - sizeof(Frame));
+        };
+        auto open = [&](uint16_t id) {
+            if (connections.fetch_sub(1) <= 0) return false;
+            push({id, PacketType::CONN_PACKET, ConnMsg::SESSION_OPEN});
+            return true;
+        };
+        auto sendMove = [&](uint16_t id) {
+            auto &session = state[id];
+            push({id, PacketType::DATA_PACKET,
+                  session.moves_[session.next_++]});
+            session.sentAt_  = Bench::Clock::now();
+            session.waiting_ = true;
+        };
+
+        array<uint8_t, sizeof(Packet)> packet;
+        string hello = {char(PacketType::CONN_PACKET),
+                        char(ConnMsg::MULTIPLEX_REQUEST)};
+        hello += botName() + "\n"; // sessions are named <name>#<id>
+        client.read(packet.data(), packet.size()); // USERNAME_REQUEST
+        client.write(hello.data(), hello.size());
+        for (uint16_t id = 0; id < sessions; ++id) active += open(id);
+
+        array<uint8_t, sizeof(Frame)> input;
+        while (active > 0)
+        {
+            if (!out.empty())
+            {
+                client.write(out.data(), out.size());
+                out.clear();
+            }
+            if (!client.read(input.data(), input.size())) break;
+            auto frame = decodeFrame(input.data());
+
+            auto &session = state[frame.sessionId_];
+            if (frame.type_ == PacketType::CONN_PACKET)
+            {
+                if (frame.data_ == ConnMsg::SESSION_CLOSE)
+                {
+                    if (!open(frame.sessionId_)) --active;
+                    continue;
+                }
+                // X takes the left column, O plays alongside it and loses.
+                bool first     = frame.data_ == ConnMsg::PLAYER1_INDICATION;
+                session.moves_ = {Move::TWO, Move::FIVE};
+                if (first)
+                    session.moves_ = {Move::ONE, Move::FOUR, Move::SEVEN};
+                session.next_ = 0;
+                if (first) sendMove(frame.sessionId_);
+                continue;
+            }
+
+            if (session.waiting_)
+            {
+                samples.push_back(std::chrono::duration<double, std::nano>(
+                                      Bench::Clock::now() - session.sentAt_)
+                                      .count());
+                session.waiting_ = false;
+            }
+            if (frame.data_ < GameResult::DRAW &&
+                session.next_ < session.moves_.size())
+                sendMove(frame.sessionId_);
+        }
+    }
+
+    // Time from connecting until the server's first packet, which for TLS
+    // includes the handshake.
+    void benchConnect(Bench::Runner &runner, const string &name,
+                      uint16_t port, SSL_CTX *tls, bool resume)
+    {
+        const uint32_t   connections = 200;
+        asio::io_service service;
+        SSL_SESSION     *session = nullptr;
+        vector<double>   samples;
+
+        if (resume)
+        {
+            Client client(service);
+            array<uint8_t, sizeof(Packet)> packet;
+            // The TLS 1.3 ticket arrives with the first application data.
+            if (client.connect(port, tls) &&
+                client.read(packet.data(), packet.size()))
+                session = client.session();
+        }
+
+        for (uint32_t i = 0; i < connections; ++i)
+        {
+            Client client(service);
+            array<uint8_t, sizeof(Packet)> packet;
+
+            auto start = Bench::Clock::now();
+            if (!client.connect(port, tls, session) ||
+                !client.read(packet.data(), packet.size()))
+                break;
+            samples.push_back(std::chrono::duration<double, std::nano>(
+                                  Bench::Clock::now() - start)
+                                  .count());
+            if (resume && !client.resumed())
+            {
+                LOG_ERR << "TLS session was not resumed.";
+                break;
+            }
+        }
+        SSL_SESSION_free(session);
+        runner.record(name, 1, std::move(samples));
+    }
+
+    void benchServer(Bench::Runner &runner, uint32_t threads)
+    {
+        const uint32_t clients = 8, games = 100;
+        uint16_t       port    = 19000;
+
+        // Every client connects from localhost, faster than any sensible
+        // per-source limit would allow.
+        RateLimit::config = {{0, 0}, {0, 0}};
+
+        // Also records the worker threads' CPU time per move, as
+        // server.cpu_per_move.<case>.
+        auto moveLatency = [&](const string &name, WorkerPolicy policy,
+                               SSL_CTX *tls, bool datagrams) {
+            Server server(threads, policy);
+            if (datagrams) server.enableDatagrams();
+            thread serverThread([&] { server.startServer(port); });
+
+            std::atomic<int32_t>   connections(2 * games);
+            vector<vector<double>> perClient(clients);
+            vector<thread>         players;
+            for (uint32_t c = 0; c < clients; ++c)
+            {
+                players.emplace_back([&, c] {
+                    if (datagrams)
+                        playDatagrams(port, connections, perClient[c]);
+                    else
+                        playGames(port, connections, perClient[c], tls);
+                });
+            }
+            for (auto &player : players) player.join();
+            auto cpu = server.workerCpuTime();
+            server.stopServer();
+            serverThread.join();
+
+            vector<double> samples;
+            for (auto &s : perClient)
+                samples.insert(samples.end(), s.begin(), s.end());
+            double cpuPerMove = double(cpu.count()) / samples.size();
+            runner.record(name, threads, std::move(samples));
+            runner.record("server.cpu_per_move" +
+                              name.substr(string("server.move_rtt").size()),
+                          threads, {cpuPerMove});
+            ++port;
+        };
+
+        auto multiplexed = [&](uint32_t sessions) {
+            Server server(threads);
+            thread serverThread([&] { server.startServer(port); });
+
+            std::atomic<int32_t> connections(2 * games);
+            vector<double>       samples;
+            playMultiplexed(port, sessions, connections, samples);
+            server.stopServer();
+            serverThread.join();
+
+            runner.record("server.move_rtt.mux.sessions=" +
+                              std::to_string(sessions),
+                          threads, std::move(samples));
+            ++port;
+        };
+
+        auto connect = [&](const string &name, SSL_CTX *tls, bool resume) {
+            Server server(threads);
+            thread serverThread([&] { server.startServer(port); });
+            benchConnect(runner, name, port, tls, resume);
+            server.stopServer();
+            serverThread.join();
+            ++port;
+        };
+
+        moveLatency("server.move_rtt.policy=block", WorkerPolicy::BLOCKING,
+                    nullptr, false);
+        moveLatency("server.move_rtt.policy=busy", WorkerPolicy::BUSY_POLL,
+                    nullptr, false);
+        moveLatency("server.move_rtt.udp", WorkerPolicy::BLOCKING, nullptr,
+                    true);
+        multiplexed(clients);
+        multiplexed(64);
+        connect("server.connect.plain", nullptr, false);
+
+        // Everything below runs with TLS enabled server-wide.
+        if (!Tls::initSelfSigned()) return;
+        SSL_CTX *tls = SSL_CTX_new(TLS_client_method());
+        connect("server.connect.tls_full", tls, false);
+        connect("server.connect.tls_resumed", tls, true);
+        moveLatency("server.move_rtt.tls", WorkerPolicy::BLOCKING, tls, false);
+        SSL_CTX_free(tls);
+    }
+
+    void benchLogger(Bench::Runner &runner, uint32_t threads)
+    {
+        const uint64_t iterations = 1 << 14;
+
+        // Throughput includes draining the asynchronous sink to the file.
+        runner.run("logger.LOG_INF.throughput", iterations, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i)
+                LOG_INF << "bench record " << i;
+            flushLogs();
+        });
+
+        for (uint32_t count : {1u, threads})
+        {
+            runner.runThreaded(
+                "logger.LOG_INF.enqueue.threads=" + std::to_string(count),
+                count, iterations / count, [&](uint32_t t, uint64_t n) {
+                    for (uint64_t i = 0; i < n; ++i)
+                        LOG_INF << "bench record " << t << ":" << i;
+                });
+            flushLogs();
+        }
+
+        // Latency is the cost seen by the calling thread, i.e. enqueueing
+        // the record into the sink.
+        vector<double> samples;
+        samples.reserve(iterations);
+        for (uint64_t i = 0; i < iterations; ++i)
+        {
+            auto start = Bench::Clock::now();
+            LOG_INF << "bench record " << i;
+            samples.push_back(std::chrono::duration<double, std::nano>(
+                                  Bench::Clock::now() - start)
+                                  .count());
+        }
+        flushLogs();
+        runner.record("logger.LOG_INF.latency", 1, std::move(samples));
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    if (!parseArgs(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+    Bench::Runner    runner(options.warmup_, options.repetitions_);
+    asio::io_service service;
+
+    initLogger("bench.log", false);
+
+    auto enabled = [&](const string &group) {
+        return options.filter_.empty() ||
+               group.find(options.filter_) != string::npos;
+    };
+
+    if (enabled("game")) benchGame(runner, service);
+    if (enabled("packet")) benchPacket(runner);
+    if (enabled("containers"))
+        benchContainers(runner, service, options.threads_);
+    if (enabled("tracer")) benchTracer(runner);
+    if (enabled("capture")) benchCapture(runner, options.threads_);
+    if (enabled("ratelimit")) benchRateLimit(runner, options.threads_);
+    if (enabled("directory"))
+        benchDirectory(runner, service, options.threads_);
+    if (enabled("logger")) benchLogger(runner, options.threads_);
+    if (enabled("server")) benchServer(runner, options.threads_);
+
+    if (options.output_.empty())
+    {
+        runner.writeJson(cout);
+    }
+    else
+    {
+        std::ofstream out(options.output_);
+        runner.writeJson(out);
+    }
+    flushLogs();
+    return 0;
+}
@@ -0,0 +1,202 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+namespace Bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Prevents the compiler from optimising away a value computed inside a
+    // benchmark body.
+    template <class T> inline void doNotOptimize(T const &value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    struct Result
+    {
+            std::string         name_;
+            uint32_t            threads_;
+            uint64_t            iterations_;
+            std::vector<double> samples_; // ns/op per repetition or per call
+            double              mean_;
+            double              stddev_;
+            double              min_;
+            double              median_;
+            double              p99_;
+            double              max_;
+    };
+
+    class Runner
+    {
+        private:
+            uint32_t            warmup_;
+            uint32_t            repetitions_;
+            std::vector<Result> results_;
+
+            void summarize(Result &result)
+            {
+                auto &s = result.samples_;
+                std::vector<double> sorted(s);
+                std::sort(sorted.begin(), sorted.end());
+
+                double sum = 0;
+                for (auto v : s) sum += v;
+                result.mean_ = sum / s.size();
+
+                double var = 0;
+                for (auto v : s) var += (v - result.mean_) * (v - result.mean_);
+                result.stddev_ = (s.size() > 1) ? std::sqrt(var / (s.size() - 1))
+                                                : 0.0;
+                result.min_    = sorted.front();
+                result.max_    = sorted.back();
+                result.median_ = sorted[sorted.size() / 2];
+                // Nearest rank, ceil(0.99 * n) - 1: with fewer than 100
+                // samples this is the maximum rather than a lower sample.
+                result.p99_ = sorted[(sorted.size() * 99 + 99) / 100 - 1];
+            }
+
+            // Writes `value` as a JSON string.
+            static void writeString(std::ostream &out, const std::string &value)
+            {
+                static const char HEX[] = "0123456789abcdef";
+                out << '"';
+                for (unsigned char c : value)
+                {
+                    if (c == '"' || c == '\\')
+                        out << '\\' << c;
+                    else if (c < 0x20)
+                        out << "\\u00" << HEX[c >> 4] << HEX[c & 15];
+                    else
+                        out << c;
+                }
+                out << '"';
+            }
+
+        public:
+            Runner(uint32_t warmup = 2, uint32_t repetitions = 10)
+                : warmup_(warmup), repetitions_(std::max(repetitions, 1u))
+            {
+            }
+
+            // Runs `body(iterations)` warmup_ + repetitions_ times on the
+            // calling thread and records ns/op for each measured repetition.
+            const Result &run(const std::string                   &name,
+                              uint64_t                              iterations,
+                              const std::function<void(uint64_t)> &body)
+            {
+                Result result{name, 1, iterations, {}, 0, 0, 0, 0, 0, 0};
+
+                for (uint32_t i = 0; i < warmup_; ++i) body(iterations);
+
+                for (uint32_t i = 0; i < repetitions_; ++i)
+                {
+                    auto start = Clock::now();
+                    body(iterations);
+                    auto ns = std::chrono::duration<double, std::nano>(
+                                  Clock::now() - start)
+                                  .count();
+                    result.samples_.push_back(ns / iterations);
+                }
+                summarize(result);
+                results_.push_back(std::move(result));
+                return results_.back();
+            }
+
+            // Runs `body(threadIndex, iterations)` concurrently on `threads`
+            // threads. All threads are released together so that the measured
+            // window covers the contended section only; ns/op is wall time
+            // divided by the total number of operations across threads.
+            const Result &
+            runThreaded(const std::string &name, uint32_t threads,
+                        uint64_t iterations,
+                        const std::function<void(uint32_t, uint64_t)> &body)
+            {
+                Result result{name, threads, iterations, {}, 0, 0, 0, 0, 0, 0};
+
+                for (uint32_t rep = 0; rep < warmup_ + repetitions_; ++rep)
+                {
+                    std::atomic<uint32_t> ready{0};
+                    std::atomic<bool>     go{false};
+                    std::vector<std::thread> workers;
+
+                    for (uint32_t t = 0; t < threads; ++t)
+                    {
+                        workers.emplace_back([&, t] {
+                            ready.fetch_add(1);
+                            while (!go.load(std::memory_order_acquire))
+                                std::this_thread::yield();
+                            body(t, iterations);
+                        });
+                    }
+                    while (ready.load() != threads) std::this_thread::yield();
+
+                    auto start = Clock::now();
+                    go.store(true, std::memory_order_release);
+                    for (auto &w : workers) w.join();
+                    auto ns = std::chrono::duration<double, std::nano>(
+                                  Clock::now() - start)
+                                  .count();
+
+                    if (rep >= warmup_)
+                        result.samples_.push_back(
+                            ns / (iterations * static_cast<double>(threads)));
+                }
+                summarize(result);
+                results_.push_back(std::move(result));
+                return results_.back();
+            }
+
+            // Records externally collected per-operation samples (e.g.
+            // individual call latencies) as a result of its own.
+            const Result &record(const std::string &name, uint32_t threads,
+                                 std::vector<double> samples)
+            {
+                Result result{name, threads, samples.size(), std::move(samples),
+                              0, 0, 0, 0, 0, 0};
+                if (result.samples_.empty()) result.samples_.push_back(0);
+                summarize(result);
+                results_.push_back(std::move(result));
+                return results_.back();
+            }
+
+            const std::vector<Result> &results() const
+            {
+                return results_;
+            }
+
+            void writeJson(std::ostream &out) const
+            {
+                out << "{\n  \"warmup\": " << warmup_
+                    << ",\n  \"repetitions\": " << repetitions_
+                    << ",\n  \"results\": [";
+                for (size_t i = 0; i < results_.size(); ++i)
+                {
+                    auto const &r = results_[i];
+                    out << (i ? "," : "") << "\n    {\"name\": ";
+                    writeString(out, r.name_);
+                    out << ", \"threads\": " << r.threads_
+                        << ", \"iterations\": " << r.iterations_
+                        << ", \"ns_per_op\": {\"mean\": " << r.mean_
+                        << ", \"stddev\": " << r.stddev_
+                        << ", \"min\": " << r.min_
+                        << ", \"median\": " << r.median_
+                        << ", \"p99\": " << r.p99_
+                        << ", \"max\": " << r.max_ << "}}";
+                }
+                out << "\n  ]\n}\n";
+            }
+    };
+} // namespace Bench
+
+#endif
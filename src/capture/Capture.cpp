@@ -0,0 +1,282 @@
+#include "Capture.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Logger.hpp"
+
+namespace Capture
+{
+    std::atomic<bool> enabled(false);
+
+    namespace
+    {
+        using Clock = std::chrono::steady_clock;
+
+        constexpr auto WRITE_INTERVAL = std::chrono::milliseconds(50);
+        // A thread buffer this full wakes the writer early, so that busy
+        // buffers stay small enough to be in cache.
+        constexpr std::size_t WAKE_SIZE = 64 * 1024;
+
+        // What record() stores ahead of each payload.
+        struct Header
+        {
+                uint64_t   seq_;
+                Clock::rep time_;
+                uint32_t   session_;
+                uint32_t   size_;
+                Kind       kind_;
+        };
+
+        // Records of one thread, headers and payloads one after the other.
+        // Its lock is only contended while the writer swaps records_ out.
+        struct ThreadBuffer
+        {
+                std::mutex           lock_;
+                std::vector<uint8_t> records_;
+                std::vector<uint8_t> taken_; // the writer's; keeps capacity
+        };
+
+        // Every record takes a number from nextRecord_ under its thread's
+        // lock. That orders them: a packet sent in reaction to another is
+        // numbered after it, whichever threads they are recorded on. The
+        // writer thread collects the buffers every WRITE_INTERVAL, merges
+        // them by number, and encodes and writes them; records that may
+        // still be missing an earlier number wait for the next round.
+        std::atomic<uint64_t>                      nextRecord_(0);
+        std::mutex                                 registryLock_;
+        std::vector<std::unique_ptr<ThreadBuffer>> registry_;
+        thread_local ThreadBuffer                 *localBuffer_ = nullptr;
+
+        // Writer state, under writeLock_.
+        std::mutex           writeLock_;
+        std::vector<uint8_t> carried_;
+        std::vector<uint8_t> carrying_;
+        std::vector<uint8_t> encoded_;
+        Clock::time_point    last_;
+        std::ofstream        file_;
+
+        std::mutex              writerLock_;
+        std::condition_variable writerWake_;
+        bool                    writerStop_ = false;
+        std::thread             writer_;
+
+        std::atomic<uint32_t> nextSession_(1);
+
+        ThreadBuffer &localBuffer()
+        {
+            if (localBuffer_ == nullptr)
+            {
+                const std::lock_guard<std::mutex> lock(registryLock_);
+                registry_.push_back(std::make_unique<ThreadBuffer>());
+                localBuffer_ = registry_.back().get();
+            }
+            return *localBuffer_;
+        }
+
+        void putVarint(std::vector<uint8_t> &out, uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out.push_back(static_cast<uint8_t>(value) | 0x80);
+                value >>= 7;
+            }
+            out.push_back(static_cast<uint8_t>(value));
+        }
+
+        void encode(const Header &header, const uint8_t *payload)
+        {
+            // Whole microseconds are taken off last_, so that the rounding
+            // does not add up over a long capture. Threads read the clock
+            // a little before or after taking their number, so a record
+            // may seem to precede the one before it; it gets no delay.
+            Clock::time_point time(Clock::duration(header.time_));
+            auto elapsed = std::chrono::microseconds::zero();
+            if (time > last_)
+            {
+                elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                    time - last_);
+                last_ += elapsed;
+            }
+            encoded_.push_back(header.kind_);
+            putVarint(encoded_, header.session_);
+            putVarint(encoded_, elapsed.count());
+            putVarint(encoded_, header.size_);
+            encoded_.insert(encoded_.end(), payload, payload + header.size_);
+        }
+
+        // One thread's records, read in order.
+        struct Run
+        {
+                const uint8_t *next_;
+                const uint8_t *end_;
+                Header         header_;
+
+                bool load()
+                {
+                    if (next_ == end_) return false;
+                    std::memcpy(&header_, next_, sizeof(header_));
+                    return true;
+                }
+        };
+
+        // Writes out every record numbered below the count at the start, or
+        // everything if `all` is set. Called with writeLock_ held.
+        void collect(bool all)
+        {
+            auto limit = nextRecord_.load();
+
+            // Every record numbered below `limit` is in its buffer once the
+            // buffer's lock has been taken here.
+            std::vector<Run> runs;
+            runs.push_back({carried_.data(), carried_.data() + carried_.size(),
+                            {}});
+            {
+                const std::lock_guard<std::mutex> lock(registryLock_);
+                for (auto &buffer : registry_)
+                {
+                    buffer->taken_.clear();
+                    {
+                        const std::lock_guard<std::mutex> bufferLock(
+                            buffer->lock_);
+                        buffer->taken_.swap(buffer->records_);
+                    }
+                    auto &taken = buffer->taken_;
+                    runs.push_back({taken.data(), taken.data() + taken.size(),
+                                    {}});
+                }
+            }
+            runs.erase(std::remove_if(runs.begin(), runs.end(),
+                                      [](Run &run) { return !run.load(); }),
+                       runs.end());
+
+            // Each run is in order; merge them.
+            encoded_.clear();
+            carrying_.clear();
+            while (!runs.empty())
+            {
+                auto first = runs.begin();
+                for (auto run = runs.begin() + 1; run != runs.end(); ++run)
+                    if (run->header_.seq_ < first->header_.seq_) first = run;
+
+                auto record  = first->next_;
+                auto payload = record + sizeof(Header);
+                first->next_ = payload + first->header_.size_;
+                if (all || first->header_.seq_ < limit)
+                    encode(first->header_, payload);
+                else
+                    carrying_.insert(carrying_.end(), record, first->next_);
+                if (!first->load()) runs.erase(first);
+            }
+            carried_.swap(carrying_);
+
+            if (encoded_.empty()) return;
+            file_.write(reinterpret_cast<const char *>(encoded_.data()),
+                        encoded_.size());
+            if (!file_.good()) LOG_ERR << "Failed to write the capture.";
+        }
+
+        void runWriter()
+        {
+            std::unique_lock<std::mutex> lock(writerLock_);
+            while (!writerStop_)
+            {
+                writerWake_.wait_for(lock, WRITE_INTERVAL);
+                lock.unlock();
+                {
+                    const std::lock_guard<std::mutex> write(writeLock_);
+                    collect(false);
+                }
+                lock.lock();
+            }
+        }
+    } // namespace
+
+    bool start(const std::string &path)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(writeLock_);
+            file_.open(path, std::ios::binary | std::ios::trunc);
+            if (!file_.good())
+            {
+                LOG_ERR << "Cannot open the capture file " << path;
+                return false;
+            }
+            file_.write(MAGIC, sizeof(MAGIC));
+            carried_.clear();
+            last_ = Clock::now();
+        }
+        writerStop_ = false;
+        writer_     = std::thread(runWriter);
+        enabled.store(true);
+        return true;
+    }
+
+    void flush()
+    {
+        if (!enabled.load()) return;
+        const std::lock_guard<std::mutex> lock(writeLock_);
+        collect(false);
+        file_.flush();
+    }
+
+    void stop()
+    {
+        if (!enabled.exchange(false)) return;
+        {
+            const std::lock_guard<std::mutex> lock(writerLock_);
+            writerStop_ = true;
+        }
+        writerWake_.notify_one();
+        writer_.join();
+
+        const std::lock_guard<std::mutex> lock(writeLock_);
+        collect(true);
+        file_.close();
+    }
+
+    uint32_t open(const std::string &userName)
+    {
+        if (__builtin_expect(!enabled.load(std::memory_order_relaxed), 1))
+            return 0;
+        auto session = nextSession_.fetch_add(1, std::memory_order_relaxed);
+        record(session, OPEN,
+               reinterpret_cast<const uint8_t *>(userName.data()),
+               userName.size());
+        return session;
+    }
+
+    void record(uint32_t session, Kind kind, const uint8_t *data,
+                std::size_t size)
+    {
+        // Recording may have stopped since the session was opened.
+        if (!enabled.load(std::memory_order_relaxed)) return;
+
+        auto  &buffer = localBuffer();
+        Header header{0, Clock::now().time_since_epoch().count(), session,
+                      static_cast<uint32_t>(size), kind};
+        const std::lock_guard<std::mutex> lock(buffer.lock_);
+        header.seq_   = nextRecord_.fetch_add(1);
+        auto &records = buffer.records_;
+        auto  at      = records.size();
+        records.resize(at + sizeof(header) + size);
+        std::memcpy(&records[at], &header, sizeof(header));
+        if (size > 0) std::memcpy(&records[at + sizeof(header)], data, size);
+        if (at < WAKE_SIZE && records.size() >= WAKE_SIZE)
+            writerWake_.notify_one();
+    }
+
+    void pair(uint32_t x, uint32_t o)
+    {
+        if (x == 0 || o == 0) return;
+        std::vector<uint8_t> payload;
+        putVarint(payload, o);
+        record(x, PAIR, payload.data(), payload.size());
+    }
+} // namespace Capture
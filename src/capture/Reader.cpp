@@ -0,0 +1,64 @@
+#include "Capture.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace Capture
+{
+    bool decodeVarint(const std::string &data, uint64_t &value)
+    {
+        value = 0;
+        for (std::size_t i = 0; i < data.size() && i < 10; ++i)
+        {
+            value |= uint64_t(uint8_t(data[i]) & 0x7F) << (7 * i);
+            if ((uint8_t(data[i]) & 0x80) == 0) return i + 1 == data.size();
+        }
+        return false;
+    }
+
+    Reader::Reader(const std::string &path)
+        : in_(path, std::ios::binary), time_(0), truncated_(false)
+    {
+        char magic[sizeof(MAGIC)];
+        if (!in_.read(magic, sizeof(magic)) ||
+            !std::equal(magic, magic + sizeof(magic), MAGIC))
+            throw std::runtime_error("Not a capture file: " + path);
+    }
+
+    bool Reader::readVarint(uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int byte = in_.get();
+            if (byte == std::char_traits<char>::eof()) return false;
+            value |= uint64_t(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    bool Reader::next(Record &record)
+    {
+        int kind = in_.get();
+        if (kind == std::char_traits<char>::eof()) return false;
+
+        uint64_t session, elapsed, size;
+        if (!readVarint(session) || !readVarint(elapsed) ||
+            !readVarint(size) || size > MAX_PAYLOAD_SIZE)
+        {
+            truncated_ = true;
+            return false;
+        }
+        record.kind_    = Kind(kind);
+        record.session_ = static_cast<uint32_t>(session);
+        record.time_    = time_ += elapsed;
+        record.payload_.resize(size);
+        if (!in_.read(&record.payload_[0], size))
+        {
+            truncated_ = true;
+            return false;
+        }
+        return true;
+    }
+} // namespace Capture
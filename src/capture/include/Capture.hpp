@@ -0,0 +1,82 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Records what every player sent and received, so that a night of real
+// traffic can be replayed against another build (see the replay tool).
+// Recording is opt-in; when it is off, each capture point costs a branch on
+// the session id being 0.
+namespace Capture
+{
+    enum Kind : uint8_t
+    {
+        OPEN = 1, // the player's username; starts a session
+        IN,       // a packet read from the player
+        OUT,      // a packet sent to the player
+        PAIR,     // a game started, with this session as X
+        HANGUP    // the player closed its connection
+    };
+
+    // A capture file is MAGIC followed by records, each being
+    //   kind (1 byte), session id, microseconds since the previous record,
+    //   payload size, payload
+    // with the numbers as LEB128 varints. PAIR's payload is the session id
+    // of player O, as a varint.
+    constexpr char MAGIC[8] = {'T', 'T', 'T', 'C', 'A', 'P', '0', '1'};
+    // Larger payloads can only come from a damaged file.
+    constexpr std::size_t MAX_PAYLOAD_SIZE = 1 << 16;
+
+    extern std::atomic<bool> enabled;
+
+    // Starts recording into `path`, which is truncated. False if it cannot
+    // be opened.
+    bool start(const std::string &path);
+    // Writes out what is buffered.
+    void flush();
+    void stop();
+
+    // Returns the id of a new session, or 0 when not recording.
+    uint32_t open(const std::string &userName);
+    void record(uint32_t session, Kind kind, const uint8_t *data = nullptr,
+                std::size_t size = 0);
+    void pair(uint32_t x, uint32_t o);
+
+    struct Record
+    {
+            Kind        kind_;
+            uint32_t    session_;
+            uint64_t    time_; // microseconds since the capture started
+            std::string payload_;
+    };
+
+    // Reads a capture file in order. A record cut short by a crash ends the
+    // file; truncated() then tells.
+    class Reader
+    {
+        private:
+            std::ifstream in_;
+            uint64_t      time_;
+            bool          truncated_;
+
+            bool readVarint(uint64_t &value);
+
+        public:
+            // Throws std::runtime_error if `path` is not a capture file.
+            explicit Reader(const std::string &path);
+
+            bool next(Record &record);
+
+            bool truncated() const
+            {
+                return truncated_;
+            }
+    };
+
+    bool decodeVarint(const std::string &data, uint64_t &value);
+} // namespace Capture
+
+#endif
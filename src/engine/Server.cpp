@@ -1,33 +1,121 @@
 #include "Server.hpp"
 
+#include <cstring>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+    // In the lobby and willing to play anyone.
+    bool waitingForAnyone(const std::shared_ptr<PlayerHandler> &handler)
+    {
+        return handler->gameReady() && handler->challenge().empty() &&
+               !handler->paired() && !handler->dropped();
+    }
+
+    // Handed off on its own rather than inside a game. Paired players are
+    // left over from challenges until the next processor pass; their game
+    // carries their socket.
+    bool handedOffAlone(const std::shared_ptr<PlayerHandler> &handler)
+    {
+        return handler->isOpen() && !handler->dropped() && !handler->paired();
+    }
+
+    inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        std::this_thread::yield();
+#endif
+    }
+} // namespace
+
 void Server::startClientProcessor()
 {
     while (!shutDownCommand_)
     {
+        int peer = takeoverPeer_.load();
+        if (peer >= 0)
+        {
+            if (handOff(peer)) return;
+            takeoverPeer_.store(-1);
+        }
+
+        // Players, games and multiplexers are inserted from worker threads.
+        clientHandlers_.adopt();
+        runningGames_.adopt();
+        multiplexers_.adopt();
+
         auto end = clientHandlers_.end();
         auto it  = clientHandlers_.begin();
 
         while (it != end)
         {
-            if ((*it)->gameReady())
+            auto &handler = *it;
+            if (handler->dropped() || handler->paired())
+            {
+                // Paired players are only left over from challenges.
+                it = clientHandlers_.remove(it);
+            }
+            else if (handler->multiplexRequested())
+            {
+                // The connection now only carries frames; its sessions
+                // join the lobby as they are opened.
+                auto mux = std::make_shared<Multiplexer>(
+                    io_service_, handler,
+                    [this](auto player) { enterLobby(std::move(player)); });
+                multiplexers_.insert(mux);
+                mux->start();
+                it = clientHandlers_.remove(it);
+            }
+            else if (!handler->gameReady())
             {
-                auto player1 = it;
                 it++;
-                while (it != end)
+            }
+            else if (!handler->challenge().empty())
+            {
+                // The opponent is looked up by name, and accepts if it is
+                // waiting for anyone or has challenged this player back.
+                auto opponent = directory_.find(handler->challenge());
+                if (opponent && opponent != handler && opponent->gameReady() &&
+                    !opponent->paired() && !opponent->dropped() &&
+                    (opponent->challenge().empty() ||
+                     opponent->challenge() == handler->userName()))
                 {
-                    if ((*it)->gameReady())
-                    {
-                        startGame(*player1, *it);
-                        clientHandlers_.remove(player1);
-                        it = clientHandlers_.remove(it);
-                        break;
-                    }
-                    else
-                        it++;
+                    auto challenger = handler;
+                    startGame(challenger, opponent);
+                    it = clientHandlers_.remove(it);
                 }
+                else
+                    it++;
             }
             else
-                it++;
+            {
+                auto partner = std::next(it);
+                while (partner != end && !waitingForAnyone(*partner))
+                    partner++;
+                if (partner == end)
+                {
+                    it++;
+                    continue;
+                }
+                startGame(handler, *partner);
+                clientHandlers_.remove(partner);
+                it = clientHandlers_.remove(it);
+            }
+        }
+
+        RateLimit::report();
+
+        for (auto muxIter = multiplexers_.begin();
+             muxIter != multiplexers_.end();)
+        {
+            if ((*muxIter)->finished())
+                muxIter = multiplexers_.remove(muxIter);
+            else
+                muxIter++;
         }
 
         auto gameIter = runningGames_.begin();
@@ -48,51 +136,117 @@ void Server::startClientProcessor()
     }
 }
 
-void Server::startServer(uint16_t port)
+void Server::startServer(uint16_t port, bool takeover)
 {
-    port_ = port;
-
-    clientHandlers_.insert(std::make_shared<PlayerHandler>(io_service_));
+    port_          = port;
+    int peer       = -1;
+    int datagramFd = -1;
 
-    initLogger("server.log", true);
-    LOG_INF << "Initializing server on port: " << port_;
+    if (takeover)
+    {
+        LOG_INF << "Taking over server on port: " << port_;
+        if (!takeOver(peer, datagramFd)) return;
+    }
+    else
+    {
+        LOG_INF << "Initializing server on port: " << port_;
 
-    tcp::endpoint endpoint(tcp::v4(), port_);
-    acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(tcp::acceptor::reuse_address(true));
-    acceptor_.bind(endpoint);
-    acceptor_.listen();
-    acceptor_.async_accept(clientHandlers_.back()->socket(), [=](auto ec) {
-        handleNewConnection(clientHandlers_.back(), ec);
-    });
+        tcp::endpoint endpoint(tcp::v4(), port_);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+    }
+    if (datagramsEnabled_ && !startDatagrams(datagramFd)) return;
+    if (!datagramsEnabled_ && datagramFd >= 0) ::close(datagramFd);
+    acceptConnection();
+    waitForSignal();
 
     for (auto i = 0; i < threadCount_; ++i)
     {
-        threadPool_.emplace_back([&] {
-            LOG_INF << "Worker thread spawned.";
-            while (!shutDownCommand_)
-            {
-                io_service_.run();
-            }
-        });
+        threadPool_.emplace_back([this] { runWorker(); });
     }
+
+    if (peer >= 0) receiveSessions(peer);
+    startHandoffListener();
     startClientProcessor();
+
+    // Only reached once the server has been stopped or handed off to a new
+    // process.
+    if (datagrams_) datagrams_->stop();
+    workGuard_.reset();
+    io_service_.stop();
+    for (auto &worker : threadPool_)
+    {
+        worker.join();
+    }
+    if (handoffListener_ >= 0)
+    {
+        ::shutdown(handoffListener_, SHUT_RDWR);
+        handoffThread_.join();
+        ::close(handoffListener_);
+    }
 }
 
-void Server::handleNewConnection(const std::shared_ptr<PlayerHandler> &handler,
-                                 err const                            &error)
+void Server::runWorker()
 {
-    handler->getUserName(); // TODO: Replace this with a login system.
+    LOG_INF << "Worker thread spawned.";
+    if (policy_ == WorkerPolicy::BLOCKING)
+    {
+        // The work guard keeps run() blocked while there is nothing to do.
+        while (!shutDownCommand_)
+        {
+            io_service_.run();
+        }
+        return;
+    }
 
-    clientHandlers_.insert(std::make_shared<PlayerHandler>(io_service_));
+    uint32_t idle = 0;
+    while (!shutDownCommand_)
+    {
+        if (io_service_.poll_one() > 0)
+        {
+            idle = 0;
+        }
+        else if (++idle < spinBudget_)
+        {
+            cpuRelax();
+        }
+        else
+        {
+            // Out of spin budget: park until the next handler is ready.
+            io_service_.run_one();
+            idle = 0;
+        }
+    }
+}
 
-    acceptor_.async_accept(clientHandlers_.back()->socket(), [=](auto ec) {
-        handleNewConnection(clientHandlers_.back(), ec);
-    });
+void Server::stopServer()
+{
+    shutDownCommand_ = true;
+}
+
+void Server::acceptConnection()
+{
+    auto handler = std::make_shared<PlayerHandler>(io_service_);
+    handler->useDirectory(directory_);
+    clientHandlers_.insert(handler);
+
+    // Accepts run on a strand so that closing the acceptor for a hot
+    // restart cannot race with re-arming it.
+    acceptor_.async_accept(handler->socket(),
+                           acceptStrand_.wrap([this, handler](auto ec) {
+                               handleNewConnection(handler, ec);
+                           }));
+}
+
+void Server::handleNewConnection(const std::shared_ptr<PlayerHandler> &handler,
+                                 err const                            &error)
+{
+    // The acceptor was closed because a new process took over.
+    if (error == asio::error::operation_aborted) return;
 
-    LOG_INF << "Incoming connection from ("
-            << handler->socket().remote_endpoint().address().to_string() << ", "
-            << handler->socket().remote_endpoint().port() << ")";
+    if (acceptor_.is_open()) acceptConnection();
 
     if (error)
     {
@@ -100,10 +254,360 @@ void Server::handleNewConnection(const std::shared_ptr<PlayerHandler> &handler,
                 << error.message();
         return;
     }
+
+    err  endpointError;
+    auto endpoint = handler->socket().remote_endpoint(endpointError);
+    if (endpointError)
+    {
+        handler->drop();
+        return;
+    }
+    // Refused before the handshake, so that a flood costs one lookup each.
+    if (!acceptLimits_.allow(endpoint.address(), RateLimit::config.accept_))
+    {
+        RateLimit::recordDrop(RateLimit::CONNECTION, endpoint.address());
+        handler->drop();
+        return;
+    }
+    // Every packet is small and waits for an answer: with Nagle a move
+    // would sit behind the delayed ACK of the previous one. The TLS
+    // handshake and session ticket also go out as several small writes.
+    err optionError;
+    handler->socket().set_option(tcp::no_delay(true), optionError);
+
+    if (Tls::enabled())
+    {
+        handler->startTls([handler](err const &error) {
+            if (error)
+            {
+                LOG_ERR << "TLS handshake failed: " << error.message();
+                handler->drop();
+                return;
+            }
+            handler->getUserName();
+        });
+    }
+    else
+    {
+        handler->getUserName(); // TODO: Replace this with a login system.
+    }
+
+    LOG_INF << "Incoming connection from (" << endpoint.address().to_string()
+            << ", " << endpoint.port() << ")";
+}
+
+void Server::enterLobby(std::shared_ptr<PlayerHandler> player)
+{
+    player->useDirectory(directory_);
+    if (!player->list())
+    {
+        player->rejectUserName();
+        return;
+    }
+    player->startCapture();
+    clientHandlers_.insert(std::move(player));
 }
 
 void Server::startGame(std::shared_ptr<PlayerHandler> &player1,
                        std::shared_ptr<PlayerHandler> &player2)
 {
+    player1->pair();
+    player2->pair();
+    Capture::pair(player1->captureId(), player2->captureId());
     runningGames_.insert(std::make_shared<Game>(player1, player2));
+}
+
+void Server::waitForSignal()
+{
+    // SIGUSR1 dumps the move traces collected so far, if tracing is enabled,
+    // and writes out the buffered capture.
+    signals_.async_wait([this](err const &error, int signal) {
+        if (error) return;
+        if (Tracing::enabled && !Tracing::dump())
+        {
+            LOG_ERR << "Failed to write the move trace.";
+        }
+        Capture::flush();
+        waitForSignal();
+    });
+}
+
+bool Server::takeOver(int &peer, int &datagramFd)
+{
+    peer = Handoff::connect(Handoff::socketPath(port_));
+    if (peer < 0)
+    {
+        LOG_ERR << "Cannot reach the running server: " << strerror(errno);
+        return false;
+    }
+
+    Handoff::Message request{Handoff::TAKEOVER_REQUEST, {}, {}};
+    Handoff::Message reply;
+    if (!Handoff::send(peer, request) || !Handoff::receive(peer, reply) ||
+        reply.type_ != Handoff::ACCEPTOR || reply.fds_.empty())
+    {
+        LOG_ERR << "Did not receive the listening socket: " << strerror(errno);
+        for (int fd : reply.fds_) ::close(fd);
+        ::close(peer);
+        return false;
+    }
+    acceptor_.assign(tcp::v4(), reply.fds_[0]);
+    // The datagram socket comes along if the running server had one.
+    if (reply.fds_.size() > 1) datagramFd = reply.fds_[1];
+    return true;
+}
+
+void Server::enableDatagrams()
+{
+    datagramsEnabled_ = true;
+}
+
+bool Server::startDatagrams(int fd)
+{
+    datagrams_ = std::make_shared<DatagramTransport>(
+        io_service_,
+        [this](const udp::endpoint &peer) {
+            if (acceptLimits_.allow(peer.address(), RateLimit::config.accept_))
+                return true;
+            RateLimit::recordDrop(RateLimit::CONNECTION, peer.address());
+            return false;
+        },
+        [this](auto player) { enterLobby(std::move(player)); });
+    return datagrams_->start(port_, fd);
+}
+
+std::size_t Server::playersOnline()
+{
+    return directory_.online();
+}
+
+std::chrono::nanoseconds Server::workerCpuTime()
+{
+    std::chrono::nanoseconds total(0);
+    for (auto &worker : threadPool_)
+    {
+        clockid_t clock;
+        timespec  time;
+        if (pthread_getcpuclockid(worker.native_handle(), &clock) != 0 ||
+            clock_gettime(clock, &time) != 0)
+            continue;
+        total += std::chrono::seconds(time.tv_sec) +
+                 std::chrono::nanoseconds(time.tv_nsec);
+    }
+    return total;
+}
+
+void Server::receiveSessions(int peer)
+{
+    size_t           players = 0, games = 0;
+    Handoff::Message message;
+
+    while (Handoff::receive(peer, message) && message.type_ != Handoff::DONE)
+    {
+        if (message.type_ == Handoff::PLAYER && message.fds_.size() == 1)
+        {
+            PlayerState state;
+            if (Handoff::decode(message.payload_, state))
+            {
+                auto handler = std::make_shared<PlayerHandler>(
+                    io_service_, message.fds_[0], state);
+                handler->useDirectory(directory_);
+                if (state.gameReady_) handler->list();
+                clientHandlers_.insert(handler);
+                handler->resumeUserName();
+                ++players;
+                continue;
+            }
+        }
+        else if (message.type_ == Handoff::GAME && message.fds_.size() == 2)
+        {
+            GameState state;
+            if (Handoff::decode(message.payload_, state))
+            {
+                auto player1 = std::make_shared<PlayerHandler>(
+                    io_service_, message.fds_[0], state.player1_);
+                auto player2 = std::make_shared<PlayerHandler>(
+                    io_service_, message.fds_[1], state.player2_);
+                for (auto &player : {player1, player2})
+                {
+                    player->useDirectory(directory_);
+                    player->list();
+                    player->pair();
+                }
+                runningGames_.insert(
+                    std::make_shared<Game>(player1, player2, state));
+                ++games;
+                continue;
+            }
+        }
+        LOG_ERR << "Discarding malformed handoff message.";
+        for (int fd : message.fds_) ::close(fd);
+    }
+    ::close(peer);
+    LOG_INF << "Took over " << players << " waiting players and " << games
+            << " running games.";
+}
+
+void Server::startHandoffListener()
+{
+    handoffListener_ = Handoff::listen(Handoff::socketPath(port_));
+    if (handoffListener_ < 0)
+    {
+        LOG_ERR << "Hot restart is unavailable: " << strerror(errno);
+        return;
+    }
+
+    handoffThread_ = thread([this] {
+        while (!shutDownCommand_)
+        {
+            int peer = Handoff::accept(handoffListener_);
+            if (peer < 0)
+            {
+                if (errno == EACCES)
+                {
+                    LOG_ERR << "Refused a takeover from another user.";
+                    continue;
+                }
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;
+            }
+
+            Handoff::Message request;
+            int              expected = -1;
+            if (Handoff::receive(peer, request) &&
+                request.type_ == Handoff::TAKEOVER_REQUEST &&
+                takeoverPeer_.compare_exchange_strong(expected, peer))
+            {
+                continue;
+            }
+            ::close(peer);
+        }
+    });
+}
+
+// Dropped players are closing and never park, so they are not waited for.
+bool Server::handoffDrained()
+{
+    for (auto it = clientHandlers_.begin(); it != clientHandlers_.end(); ++it)
+    {
+        if (handedOffAlone(*it) && !(*it)->handoffReady()) return false;
+    }
+    for (auto it = runningGames_.begin(); it != runningGames_.end(); ++it)
+    {
+        if (!(*it)->gameOver() && !(*it)->parked()) return false;
+    }
+    return true;
+}
+
+bool Server::handOff(int peer)
+{
+    LOG_INF << "Handing off to a new server process.";
+
+    Handoff::Message message{Handoff::ACCEPTOR, {acceptor_.native_handle()},
+                             {}};
+    if (datagrams_) message.fds_.push_back(datagrams_->nativeHandle());
+    if (!Handoff::send(peer, message))
+    {
+        LOG_ERR << "Failed to hand off the listening socket: "
+                << strerror(errno);
+        ::close(peer);
+        return false;
+    }
+
+    // From here on the new process accepts connections. Close our copy of
+    // the acceptor on its strand and wait until that is done, so that no
+    // new player shows up while sessions are being collected.
+    std::promise<void> closed;
+    acceptStrand_.post([&] {
+        err error;
+        acceptor_.close(error);
+        closed.set_value();
+    });
+    closed.get_future().wait();
+    // Datagrams for our sessions now reach the new process, which resets
+    // them.
+    if (datagrams_) datagrams_->stop();
+    clientHandlers_.adopt();
+    runningGames_.adopt();
+
+    // Let every session reach a point where no read is in flight.
+    for (auto it = clientHandlers_.begin(); it != clientHandlers_.end(); ++it)
+    {
+        if (handedOffAlone(*it)) (*it)->requestHandoff();
+    }
+    for (auto it = runningGames_.begin(); it != runningGames_.end(); ++it)
+    {
+        if (!(*it)->gameOver()) (*it)->requestHandoff();
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + HANDOFF_DRAIN_TIMEOUT;
+    while (!handoffDrained() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    size_t players = 0, games = 0;
+    for (auto it = clientHandlers_.begin(); it != clientHandlers_.end(); ++it)
+    {
+        auto &handler = *it;
+        if (!handedOffAlone(handler)) continue;
+        if (!handler->handoffReady())
+        {
+            LOG_ERR << "Player could not be drained in time, dropping it.";
+            continue;
+        }
+        if (!handler->handoffSupported())
+        {
+            LOG_ERR << "Dropping " << handler->userName()
+                    << ": its socket cannot be handed off.";
+            continue;
+        }
+        message = {Handoff::PLAYER,
+                   {handler->socket().native_handle()},
+                   Handoff::encode(handler->saveState())};
+        if (Handoff::send(peer, message))
+            ++players;
+        else
+            LOG_ERR << "Failed to hand off player: " << strerror(errno);
+    }
+
+    for (auto it = runningGames_.begin(); it != runningGames_.end(); ++it)
+    {
+        auto &game = *it;
+        if (game->gameOver()) continue;
+
+        if (!game->parked())
+        {
+            LOG_ERR << "Game between " << game->player1()->userName()
+                    << " and " << game->player2()->userName()
+                    << " could not be drained in time, dropping it.";
+            continue;
+        }
+        if (!game->player1()->handoffSupported() ||
+            !game->player2()->handoffSupported())
+        {
+            LOG_ERR << "Dropping game between "
+                    << game->player1()->userName() << " and "
+                    << game->player2()->userName()
+                    << ": its socket cannot be handed off.";
+            continue;
+        }
+        message = {Handoff::GAME,
+                   {game->player1()->socket().native_handle(),
+                    game->player2()->socket().native_handle()},
+                   Handoff::encode(game->saveState())};
+        if (Handoff::send(peer, message))
+            ++games;
+        else
+            LOG_ERR << "Failed to hand off game: " << strerror(errno);
+    }
+
+    message = {Handoff::DONE, {}, {}};
+    Handoff::send(peer, message);
+    ::close(peer);
+
+    LOG_INF << "Handed off " << players << " waiting players and " << games
+            << " running games.";
+    shutDownCommand_ = true;
+    return true;
 }
\ No newline at end of file
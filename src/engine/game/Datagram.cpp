@@ -0,0 +1,591 @@
+#include "Datagram.hpp"
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <cstring>
+
+namespace GameLib
+{
+    DatagramTransport::DatagramTransport(
+        asio::io_service                                   &service,
+        std::function<bool(const udp::endpoint &)>          admit,
+        std::function<void(std::shared_ptr<PlayerHandler>)> onSession)
+        : service_(service), socket_(service), sweep_(service),
+          admit_(std::move(admit)), onSession_(std::move(onSession)),
+          ids_(std::random_device()()), flushing_(false)
+    {
+        for (std::size_t i = 0; i < BATCH; ++i)
+            inVecs_[i] = {inData_[i].data(), inData_[i].size()};
+        if (RAND_bytes(cookieKey_.data(), cookieKey_.size()) != 1)
+        {
+            std::random_device random;
+            for (auto &byte : cookieKey_) byte = random();
+        }
+    }
+
+    bool DatagramTransport::start(uint16_t port, int fd)
+    {
+        const lock_guard<mutex> lock(lock_);
+        err                     error;
+        if (fd >= 0)
+        {
+            socket_.assign(udp::v4(), fd, error);
+        }
+        else
+        {
+            socket_.open(udp::v4(), error);
+            if (!error) socket_.bind(udp::endpoint(udp::v4(), port), error);
+        }
+        if (!error) socket_.non_blocking(true, error);
+        if (error)
+        {
+            LOG_ERR << "Cannot open the datagram socket: " << error.message();
+            return false;
+        }
+
+        LOG_INF << "Accepting datagram sessions on port: " << port;
+        receive();
+        sweep();
+        return true;
+    }
+
+    void DatagramTransport::stop()
+    {
+        const lock_guard<mutex> lock(lock_);
+        err                     error;
+        sweep_.cancel(error);
+        socket_.close(error);
+    }
+
+    int DatagramTransport::nativeHandle()
+    {
+        const lock_guard<mutex> lock(lock_);
+        return socket_.native_handle();
+    }
+
+    // lock_ is held by the caller.
+    void DatagramTransport::receive()
+    {
+        socket_.async_wait(udp::socket::wait_read,
+                           [this, self = shared_from_this()](err const &error) {
+                               if (!error) receiveBatch();
+                           });
+    }
+
+    void DatagramTransport::receiveBatch()
+    {
+        vector<std::shared_ptr<PlayerHandler>> opened;
+        {
+            const lock_guard<mutex> lock(lock_);
+            if (!socket_.is_open()) return;
+
+            // A few batches at most, so that a flood cannot hold the lock;
+            // whatever is left wakes the next wait straight away.
+            for (int round = 0; round < 4; ++round)
+            {
+                for (std::size_t i = 0; i < BATCH; ++i)
+                {
+                    inMsgs_[i]                    = {};
+                    inMsgs_[i].msg_hdr.msg_name    = &inAddrs_[i];
+                    inMsgs_[i].msg_hdr.msg_namelen = sizeof(inAddrs_[i]);
+                    inMsgs_[i].msg_hdr.msg_iov     = &inVecs_[i];
+                    inMsgs_[i].msg_hdr.msg_iovlen  = 1;
+                }
+                int received = ::recvmmsg(socket_.native_handle(),
+                                          inMsgs_.data(), BATCH, MSG_DONTWAIT,
+                                          nullptr);
+                if (received <= 0) break;
+
+                for (int i = 0; i < received; ++i)
+                {
+                    udp::endpoint peer;
+                    auto          length = std::min<std::size_t>(
+                        inMsgs_[i].msg_hdr.msg_namelen, peer.capacity());
+                    std::memcpy(peer.data(), &inAddrs_[i], length);
+                    peer.resize(length);
+                    handle(inData_[i].data(), inMsgs_[i].msg_len, peer,
+                           opened);
+                }
+                if (std::size_t(received) < BATCH) break;
+            }
+
+            // One ACK per session and batch, unless DATA already carried it.
+            for (auto id : acksDue_)
+            {
+                auto it = sessions_.find(id);
+                if (it == sessions_.end() || !it->second.ackDue_) continue;
+                it->second.ackDue_ = false;
+                queue(it->second.peer_, {id, ACK, 0, it->second.expected_});
+            }
+            acksDue_.clear();
+            flush();
+            receive();
+        }
+        for (auto &player : opened) onSession_(std::move(player));
+    }
+
+    void DatagramTransport::handle(
+        const uint8_t *data, std::size_t size, const udp::endpoint &peer,
+        vector<std::shared_ptr<PlayerHandler>> &opened)
+    {
+        if (size < sizeof(DatagramHeader))
+        {
+            RateLimit::recordDrop(RateLimit::INVALID_PACKET, peer.address());
+            return;
+        }
+        auto header = decodeHeader(data);
+        if (header.kind_ == HELLO)
+        {
+            hello(data, size, peer, opened);
+            return;
+        }
+
+        auto id = header.sessionId_;
+        auto it = sessions_.find(id);
+        if (it == sessions_.end() || it->second.peer_ != peer)
+        {
+            // Closed, or opened by the process this one took over from:
+            // the client has to say HELLO again.
+            queue(peer, {id, RESET, 0, 0});
+            return;
+        }
+
+        auto &session = it->second;
+        if (!session.packets_.consume(RateLimit::config.packets_))
+        {
+            RateLimit::recordDrop(RateLimit::THROTTLE, peer.address());
+            return;
+        }
+        session.lastHeard_ = Clock::now();
+        acknowledge(session, header.ack_);
+
+        switch (header.kind_)
+        {
+            case DATA:
+                if (size < sizeof(header) + sizeof(Packet))
+                {
+                    RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                          peer.address());
+                    break;
+                }
+                deliver(session, header.seq_,
+                        Packet(data[sizeof(header)], data[sizeof(header) + 1]));
+                // Duplicates and early arrivals are acked too, so that the
+                // sender learns what is missing.
+                if (!session.ackDue_)
+                {
+                    session.ackDue_ = true;
+                    acksDue_.push_back(id);
+                }
+                break;
+            case ACK:
+                break;
+            case BYE:
+                fail(id, asio::error::connection_reset);
+                return;
+            default:
+                RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                      peer.address());
+                break;
+        }
+
+        if (session.closing_ && session.unacked_.empty()) erase(id);
+    }
+
+    // Source addresses are trivial to spoof, so a session is only opened,
+    // and its username claimed, once the client echoes the cookie sent to
+    // its address.
+    void DatagramTransport::hello(
+        const uint8_t *data, std::size_t size, const udp::endpoint &peer,
+        vector<std::shared_ptr<PlayerHandler>> &opened)
+    {
+        constexpr std::size_t prefix = sizeof(DatagramHeader) +
+                                       2 * sizeof(uint64_t);
+        string userName(data + std::min(prefix, size), data + size);
+        if (!userName.empty() && userName.back() == '\n') userName.pop_back();
+        if (userName.empty())
+        {
+            RateLimit::recordDrop(RateLimit::INVALID_PACKET, peer.address());
+            return;
+        }
+        uint64_t nonce, echoed;
+        std::memcpy(&nonce, data + sizeof(DatagramHeader), sizeof(nonce));
+        std::memcpy(&echoed, data + sizeof(DatagramHeader) + sizeof(nonce),
+                    sizeof(echoed));
+        if (echoed != cookie(peer, nonce))
+        {
+            welcome(peer, 0, nonce);
+            return;
+        }
+
+        auto known = byPeer_.find(peer);
+        if (known != byPeer_.end())
+        {
+            auto id = known->second;
+            // The WELCOME was lost.
+            if (sessions_.at(id).nonce_ == nonce)
+            {
+                welcome(peer, id, nonce);
+                return;
+            }
+            // The client started over.
+            fail(id, asio::error::connection_reset);
+        }
+        if (sessions_.size() >= MAX_SESSIONS || !admit_(peer)) return;
+
+        uint32_t id;
+        do
+        {
+            id = ids_();
+        } while (id == 0 || sessions_.count(id) != 0);
+
+        auto &session = sessions_
+                            .emplace(std::piecewise_construct,
+                                     std::forward_as_tuple(id),
+                                     std::forward_as_tuple(std::ref(service_)))
+                            .first->second;
+        session.peer_      = peer;
+        session.nonce_     = nonce;
+        session.lastHeard_ = Clock::now();
+        byPeer_[peer]      = id;
+
+        auto player = std::make_shared<PlayerHandler>(
+            service_, shared_from_this(), id, userName);
+        session.player_ = player;
+        opened.push_back(std::move(player));
+        welcome(peer, id, nonce);
+    }
+
+    uint64_t DatagramTransport::cookie(const udp::endpoint &peer,
+                                       uint64_t             nonce)
+    {
+        auto address = peer.address();
+        auto v6      = address.is_v4()
+                           ? asio::ip::make_address_v6(asio::ip::v4_mapped,
+                                                       address.to_v4())
+                           : address.to_v6();
+        auto port    = peer.port();
+
+        array<uint8_t, 16 + sizeof(port) + sizeof(nonce)> input;
+        auto bytes = v6.to_bytes();
+        std::copy(bytes.begin(), bytes.end(), input.begin());
+        std::memcpy(input.data() + 16, &port, sizeof(port));
+        std::memcpy(input.data() + 16 + sizeof(port), &nonce, sizeof(nonce));
+
+        uint8_t  digest[EVP_MAX_MD_SIZE];
+        unsigned length = 0;
+        HMAC(EVP_sha256(), cookieKey_.data(), cookieKey_.size(), input.data(),
+             input.size(), digest, &length);
+        uint64_t value;
+        std::memcpy(&value, digest, sizeof(value));
+        return value;
+    }
+
+    // Session id 0 asks the client to say HELLO again with the cookie.
+    void DatagramTransport::welcome(const udp::endpoint &peer, uint32_t id,
+                                    uint64_t nonce)
+    {
+        uint64_t payload[] = {nonce, cookie(peer, nonce)};
+        queue(peer, {id, WELCOME, 0, 0}, payload, sizeof(payload));
+    }
+
+    void DatagramTransport::acknowledge(Session &session, uint16_t ack)
+    {
+        auto now      = Clock::now();
+        bool progress = false;
+        while (!session.unacked_.empty() &&
+               seqBefore(session.unacked_.front().seq_, ack))
+        {
+            auto &message = session.unacked_.front();
+            // Only unambiguous samples: a resent message may have been
+            // acked by either copy.
+            if (!message.resent_)
+            {
+                auto sample = now - message.sentAt_;
+                if (session.srtt_ == Clock::duration::zero())
+                {
+                    session.srtt_   = sample;
+                    session.rttvar_ = sample / 2;
+                }
+                else
+                {
+                    auto delta      = session.srtt_ > sample
+                                          ? session.srtt_ - sample
+                                          : sample - session.srtt_;
+                    session.rttvar_ = (3 * session.rttvar_ + delta) / 4;
+                    session.srtt_   = (7 * session.srtt_ + sample) / 8;
+                }
+                session.rto_ = std::clamp(session.srtt_ + 4 * session.rttvar_,
+                                          MIN_RTO, MAX_RTO);
+            }
+            session.unacked_.pop_front();
+            progress = true;
+        }
+        if (progress) session.retries_ = 0;
+    }
+
+    void DatagramTransport::deliver(Session &session, uint16_t seq,
+                                    Packet packet)
+    {
+        if (seq != session.expected_) return;
+
+        if (session.read_)
+        {
+            session.readBuffer_[0] = packet.type_;
+            session.readBuffer_[1] = packet.data_;
+            complete(std::move(session.read_), err(), sizeof(Packet));
+            session.read_ = nullptr;
+        }
+        else if (session.inbox_.size() < Game::MAX_POSSIBLE_MOVES)
+        {
+            session.inbox_.push_back(packet);
+        }
+        else
+        {
+            // Left unacked; the client sends it again.
+            return;
+        }
+        ++session.expected_;
+    }
+
+    void DatagramTransport::queue(const udp::endpoint &peer,
+                                  DatagramHeader header, const void *payload,
+                                  uint8_t size)
+    {
+        pending_.emplace_back();
+        auto &datagram = pending_.back();
+        datagram.peer_ = peer;
+        datagram.size_ = sizeof(header) + size;
+        encodeHeader(header, datagram.data_.data());
+        if (size != 0)
+            std::memcpy(datagram.data_.data() + sizeof(header), payload, size);
+    }
+
+    void DatagramTransport::queueData(uint32_t id, Session &session,
+                                      const Message &message)
+    {
+        queue(session.peer_, {id, DATA, message.seq_, session.expected_},
+              &message.packet_, sizeof(Packet));
+        session.ackDue_ = false;
+    }
+
+    void DatagramTransport::arm(uint32_t id, Session &session,
+                                Clock::time_point when)
+    {
+        session.armed_ = true;
+        session.retransmit_.expires_at(when);
+        session.retransmit_.async_wait(
+            [this, self = shared_from_this(), id](err const &error) {
+                retransmit(id);
+            });
+    }
+
+    // The timer is not cancelled when messages are acked; it only rechecks
+    // the oldest unacked message when it fires.
+    void DatagramTransport::retransmit(uint32_t id)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(id);
+        if (it == sessions_.end()) return;
+
+        auto &session  = it->second;
+        session.armed_ = false;
+        if (session.unacked_.empty()) return;
+
+        auto now = Clock::now();
+        auto due = session.unacked_.front().sentAt_ + session.rto_;
+        if (due > now)
+        {
+            arm(id, session, due);
+            return;
+        }
+        if (++session.retries_ > MAX_RETRIES)
+        {
+            fail(id, asio::error::timed_out);
+            return;
+        }
+
+        session.rto_ = std::min(2 * session.rto_, MAX_RTO);
+        for (auto &message : session.unacked_)
+        {
+            message.sentAt_ = now;
+            message.resent_ = true;
+            queueData(id, session, message);
+        }
+        arm(id, session, now + session.rto_);
+        flush();
+    }
+
+    void DatagramTransport::sweep()
+    {
+        sweep_.expires_after(std::chrono::seconds(1));
+        sweep_.async_wait([this, self = shared_from_this()](err const &error) {
+            if (error) return;
+            const lock_guard<mutex> lock(lock_);
+            auto                    now = Clock::now();
+            vector<uint32_t>        idle;
+            for (auto &entry : sessions_)
+            {
+                if (now - entry.second.lastHeard_ > IDLE_TIMEOUT)
+                    idle.push_back(entry.first);
+            }
+            for (auto id : idle) fail(id, asio::error::timed_out);
+            if (!idle.empty())
+                LOG_INF << idle.size() << " datagram sessions timed out.";
+            if (socket_.is_open()) sweep();
+        });
+    }
+
+    // A session that failed is forgotten at once; a player still waiting
+    // in the lobby is dropped from it.
+    void DatagramTransport::fail(uint32_t id, err error)
+    {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) return;
+
+        auto &session = it->second;
+        if (session.read_)
+        {
+            complete(std::move(session.read_), error, 0);
+            session.read_ = nullptr;
+        }
+        if (auto player = session.player_.lock()) player->drop();
+        erase(id);
+    }
+
+    void DatagramTransport::erase(uint32_t id)
+    {
+        auto it = sessions_.find(id);
+        if (it == sessions_.end()) return;
+
+        auto peer = byPeer_.find(it->second.peer_);
+        if (peer != byPeer_.end() && peer->second == id) byPeer_.erase(peer);
+        sessions_.erase(it);
+    }
+
+    // Deferred, so that the other games whose handlers are already queued
+    // add their datagrams to the same sendmmsg.
+    void DatagramTransport::scheduleFlush()
+    {
+        if (flushing_) return;
+        flushing_ = true;
+        asio::post(service_, [this, self = shared_from_this()] {
+            const lock_guard<mutex> lock(lock_);
+            flushing_ = false;
+            flush();
+        });
+    }
+
+    // lock_ is held by the caller.
+    void DatagramTransport::flush()
+    {
+        array<mmsghdr, BATCH> messages;
+        array<iovec, BATCH>   vectors;
+        std::size_t           sent = 0;
+
+        while (socket_.is_open() && sent < pending_.size())
+        {
+            auto count = std::min(BATCH, pending_.size() - sent);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto &datagram = pending_[sent + i];
+                vectors[i]     = {datagram.data_.data(), datagram.size_};
+                messages[i]    = {};
+                messages[i].msg_hdr.msg_name    = datagram.peer_.data();
+                messages[i].msg_hdr.msg_namelen = datagram.peer_.size();
+                messages[i].msg_hdr.msg_iov     = &vectors[i];
+                messages[i].msg_hdr.msg_iovlen  = 1;
+            }
+            int result = ::sendmmsg(socket_.native_handle(), messages.data(),
+                                    count, MSG_DONTWAIT);
+            if (result > 0)
+                sent += result;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break; // lost like any datagram; DATA is resent
+            else if (errno != EINTR)
+                ++sent; // skip the datagram the kernel refused
+        }
+        pending_.clear();
+
+        if (pendingCbs_.empty()) return;
+        auto error = socket_.is_open() ? err() : asio::error::not_connected;
+        asio::post(service_, [callbacks = std::move(pendingCbs_), error] {
+            for (auto &cb : callbacks) cb(error, error ? 0 : sizeof(Packet));
+        });
+        pendingCbs_.clear();
+    }
+
+    void DatagramTransport::send(uint32_t sessionId, Packet packet,
+                                 Handler cb)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end() || it->second.closing_)
+        {
+            complete(std::move(cb), asio::error::not_connected, 0);
+            return;
+        }
+
+        auto &session = it->second;
+        auto  now     = Clock::now();
+        session.unacked_.push_back({session.nextSeq_++, packet, now, false});
+        queueData(sessionId, session, session.unacked_.back());
+        if (!session.armed_) arm(sessionId, session, now + session.rto_);
+        pendingCbs_.push_back(std::move(cb));
+        scheduleFlush();
+    }
+
+    void DatagramTransport::read(uint32_t sessionId, uint8_t *buffer,
+                                 Handler cb)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end())
+        {
+            complete(std::move(cb), asio::error::not_connected, 0);
+            return;
+        }
+
+        auto &session = it->second;
+        if (!session.inbox_.empty())
+        {
+            buffer[0] = session.inbox_.front().type_;
+            buffer[1] = session.inbox_.front().data_;
+            session.inbox_.pop_front();
+            complete(std::move(cb), err(), sizeof(Packet));
+        }
+        else
+        {
+            session.readBuffer_ = buffer;
+            session.read_       = std::move(cb);
+        }
+    }
+
+    void DatagramTransport::cancelRead(uint32_t sessionId)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end() || !it->second.read_) return;
+        complete(std::move(it->second.read_), asio::error::operation_aborted,
+                 0);
+        it->second.read_ = nullptr;
+    }
+
+    // The session lingers until its last packets, usually the result, are
+    // acked or given up on.
+    void DatagramTransport::closeSession(uint32_t sessionId)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end()) return;
+
+        it->second.closing_ = true;
+        it->second.player_.reset();
+        if (it->second.unacked_.empty()) erase(sessionId);
+    }
+
+    void DatagramTransport::complete(Handler cb, err error, std::size_t bytes)
+    {
+        asio::post(service_, [cb, error, bytes] { cb(error, bytes); });
+    }
+} // namespace GameLib
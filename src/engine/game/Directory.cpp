@@ -0,0 +1,51 @@
+#include "Directory.hpp"
+
+namespace GameLib
+{
+    PlayerDirectory::Shard &PlayerDirectory::shardOf(const string &userName)
+    {
+        return shards_[std::hash<string>()(userName) % SHARDS];
+    }
+
+    bool PlayerDirectory::add(const std::shared_ptr<PlayerHandler> &player)
+    {
+        auto                   &shard = shardOf(player->userName());
+        const lock_guard<mutex> lock(shard.lock_);
+
+        auto result = shard.players_.try_emplace(player->userName(),
+                                                 Entry{player.get(), player});
+        if (!result.second)
+        {
+            // A player that is gone but has not been removed yet does not
+            // hold on to its name.
+            auto &entry = result.first->second;
+            if (!entry.handle_.expired()) return false;
+            entry = Entry{player.get(), player};
+            return true;
+        }
+        online_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void PlayerDirectory::remove(PlayerHandler &player)
+    {
+        auto                   &shard = shardOf(player.userName());
+        const lock_guard<mutex> lock(shard.lock_);
+
+        auto it = shard.players_.find(player.userName());
+        if (it == shard.players_.end() || it->second.player_ != &player)
+            return;
+        shard.players_.erase(it);
+        online_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<PlayerHandler> PlayerDirectory::find(const string &userName)
+    {
+        auto                   &shard = shardOf(userName);
+        const lock_guard<mutex> lock(shard.lock_);
+
+        auto it = shard.players_.find(userName);
+        if (it == shard.players_.end()) return nullptr;
+        return it->second.handle_.lock();
+    }
+} // namespace GameLib
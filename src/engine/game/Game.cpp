@@ -1,7 +1,68 @@
 #include "Game.hpp"
+#include "Directory.hpp"
 
 namespace GameLib
 {
+    void PlayerHandler::cancelRead()
+    {
+        if (transport_)
+        {
+            transport_->cancelRead(sessionId_);
+            return;
+        }
+        // Cancelling the socket aborts its writes too, such as a game's
+        // PLAYER*_INDICATION, so it waits until none is in flight.
+        cancelPending_.store(true);
+        if (writing_.load() == 0) cancelPendingRead();
+    }
+
+    void PlayerHandler::writeDone()
+    {
+        if (writing_.fetch_sub(1) == 1) cancelPendingRead();
+    }
+
+    void PlayerHandler::cancelPendingRead()
+    {
+        if (!cancelPending_.exchange(false)) return;
+        err error;
+        socket_.cancel(error);
+    }
+
+    bool PlayerHandler::list()
+    {
+        if (directory_ == nullptr) return true;
+        listed_ = directory_->add(shared_from_this());
+        return listed_;
+    }
+
+    void PlayerHandler::unlist()
+    {
+        if (!listed_) return;
+        listed_ = false;
+        directory_->remove(*this);
+    }
+
+    void PlayerHandler::rejectUserName()
+    {
+        LOG_INF << "Turning away a second player named " << userName_;
+        dropped_ = true;
+        sendMsg(Packet::create(PacketType::CONN_PACKET,
+                               ConnMsg::USERNAME_TAKEN),
+                [self = shared_from_this()](err const  &error,
+                                            std::size_t bytes_transferred) {
+                    self->close();
+                });
+    }
+
+    void PlayerHandler::close()
+    {
+        unlist();
+        if (transport_)
+            transport_->closeSession(sessionId_);
+        else
+            socket_.close();
+    }
+
     void Game::setup()
     {
         player1_->sendMsg(
@@ -27,14 +88,42 @@ namespace GameLib
         readMove(PlayerIdentifer::X);
     }
 
+    void Game::resetBoard()
+    {
+        for (auto &row : board_)
+        {
+            std::fill(row.begin(), row.end(), EMPTY);
+        }
+        moveCount_ = 0;
+    }
+
     void Game::readMove(PlayerIdentifer identifer)
     {
+        // The read is issued under the lock so that a concurrent handoff
+        // request either sees it in flight and cancels it, or parks the
+        // game before it is issued.
+        const lock_guard<mutex> lock(handoffLock_);
+        awaiting_ = identifer;
+        if (handoff_)
+        {
+            parked_ = true;
+            return;
+        }
+        reading_ = true;
+
         if (identifer == PlayerIdentifer::X)
         {
             player1_->readMove(
                 [this](err const &error, std::size_t bytes_transferred) {
                     // LOG_INF << "Num of bytes recv p1: " << bytes_transferred;
                     // LOG_INF << "Read move error p1: " << error.message();
+                    if (moveReadCancelled(error)) return;
+                    if (error) return forfeit(PlayerIdentifer::X);
+                    if (!moveAccepted(PlayerIdentifer::X)) return;
+                    traceId_ = Tracing::beginMove();
+                    Tracing::record(traceId_, Tracing::READ_COMPLETE,
+                                    player1_->readCompletedAt());
+                    Tracing::record(traceId_, Tracing::HANDLER_DISPATCH);
                     updateBoardAndCheckResult(PlayerIdentifer::X,
                                               player1_->getMove());
                 });
@@ -45,20 +134,85 @@ namespace GameLib
                 [this](err const &error, std::size_t bytes_transferred) {
                     // LOG_INF << "Num of bytes recv p2: " << bytes_transferred;
                     // LOG_INF << "Read move error p2: " << error.message();
+                    if (moveReadCancelled(error)) return;
+                    if (error) return forfeit(PlayerIdentifer::O);
+                    if (!moveAccepted(PlayerIdentifer::O)) return;
+                    traceId_ = Tracing::beginMove();
+                    Tracing::record(traceId_, Tracing::READ_COMPLETE,
+                                    player2_->readCompletedAt());
+                    Tracing::record(traceId_, Tracing::HANDLER_DISPATCH);
                     updateBoardAndCheckResult(PlayerIdentifer::O,
                                               player2_->getMove());
                 });
         }
     }
 
+    bool Game::moveReadCancelled(err const &error)
+    {
+        const lock_guard<mutex> lock(handoffLock_);
+        reading_ = false;
+        if (handoff_ && error == asio::error::operation_aborted)
+        {
+            parked_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    // A packet that is not a move is ignored and the player is asked again,
+    // until its packet bucket runs dry and it forfeits.
+    bool Game::moveAccepted(PlayerIdentifer id)
+    {
+        auto   &player = (id == PlayerIdentifer::X) ? player1_ : player2_;
+        uint8_t move   = player->getMove();
+        bool    valid  = player->packetType() == PacketType::DATA_PACKET &&
+                     move >= Move::ONE && move <= Move::NINE;
+
+        if (!player->allowPacket(valid))
+        {
+            RateLimit::recordDrop(RateLimit::DISCONNECT, player->userName());
+            forfeit(id);
+            return false;
+        }
+        if (!valid)
+        {
+            RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                  player->userName());
+            readMove(id);
+            return false;
+        }
+        return true;
+    }
+
+    // Ends the game in favour of the opponent of `id`, who is told the
+    // result; both connections are closed with the game.
+    void Game::forfeit(PlayerIdentifer id)
+    {
+        auto &opponent = (id == PlayerIdentifer::X) ? player2_ : player1_;
+        gameResult_ = (id == PlayerIdentifer::X) ? GameResult::O_WIN
+                                                  : GameResult::X_WIN;
+        LOG_INF << "Game between " << player1_->userName() << " and "
+                << player2_->userName() << " forfeited: "
+                << to_string(gameResult_);
+        opponent->sendMsg(
+            Packet::create(PacketType::DATA_PACKET, gameResult_),
+            [this](err const &error, std::size_t bytes_transferred) {
+                gameOver_ = true;
+            });
+    }
+
     void Game::sendMove(PlayerIdentifer identifer, uint8_t move,
                         bool finalMove = false)
     {
+        // sendResultToPlayers has recorded the send of a final move.
+        if (!finalMove) Tracing::record(traceId_, Tracing::SEND_ISSUED);
         if (identifer == PlayerIdentifer::X)
         {
             player1_->sendMsg(Packet::create(PacketType::DATA_PACKET, move),
                               [this, finalMove](err const  &error,
                                                 std::size_t bytes_transferred) {
+                                  Tracing::record(traceId_,
+                                                  Tracing::SEND_COMPLETE);
                                   if (!finalMove)
                                   {
                                       readMove(PlayerIdentifer::X);
@@ -74,6 +228,8 @@ namespace GameLib
             player2_->sendMsg(Packet::create(PacketType::DATA_PACKET, move),
                               [this, finalMove](err const  &error,
                                                 std::size_t bytes_transferred) {
+                                  Tracing::record(traceId_,
+                                                  Tracing::SEND_COMPLETE);
                                   if (!finalMove)
                                   {
                                       readMove(PlayerIdentifer::O);
@@ -151,6 +307,7 @@ namespace GameLib
         moveCount_++;
         updateBoard(id, move);
         gameResult_ = checkResult();
+        Tracing::record(traceId_, Tracing::BOARD_UPDATE);
 
         if (gameResult_ == GameResult::NO_RESULT)
         {
@@ -171,6 +328,7 @@ namespace GameLib
 
     void Game::sendResultToPlayers(uint8_t move)
     {
+        Tracing::record(traceId_, Tracing::SEND_ISSUED);
         switch (gameResult_)
         {
             case GameResult::DRAW:
@@ -182,6 +340,8 @@ namespace GameLib
                                            gameResult_),
                             [this](err const  &error,
                                    std::size_t bytes_transferred) {
+                                Tracing::record(traceId_,
+                                                Tracing::SEND_COMPLETE);
                                 gameOver_ = true;
                             });
                     });
@@ -226,4 +386,29 @@ namespace GameLib
     {
         return gameOver_;
     }
+
+    void Game::requestHandoff()
+    {
+        const lock_guard<mutex> lock(handoffLock_);
+        handoff_ = true;
+        if (reading_)
+        {
+            // A partially received move stays in the player's input buffer.
+            auto &player =
+                (awaiting_ == PlayerIdentifer::X) ? player1_ : player2_;
+            player->cancelRead();
+        }
+    }
+
+    bool Game::parked()
+    {
+        const lock_guard<mutex> lock(handoffLock_);
+        return parked_;
+    }
+
+    GameState Game::saveState()
+    {
+        return GameState{board_, moveCount_, awaiting_,
+                         player1_->saveState(), player2_->saveState()};
+    }
 } // namespace GameLib
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "Multiplexer.hpp"
+
+#include <cstring>
+
+namespace GameLib
+{
+    Multiplexer::Multiplexer(
+        asio::io_service &service, std::shared_ptr<PlayerHandler> connection,
+        std::function<void(std::shared_ptr<PlayerHandler>)> onSession)
+        : service_(service), connection_(std::move(connection)),
+          onSession_(std::move(onSession)), readBytes_(0), flushing_(false),
+          writes_(0), frames_(0), throttle_(RateLimit::Clock::duration::zero()),
+          resume_(service)
+    {
+    }
+
+    void Multiplexer::start()
+    {
+        LOG_INF << "Multiplexed connection from " << connection_->userName();
+
+        // Frames that arrived together with the username line.
+        auto input = connection_->takeBufferedInput();
+        readBuffer_.resize(std::max(READ_BUFFER_SIZE, input.size()));
+        std::copy(input.begin(), input.end(), readBuffer_.begin());
+        readBytes_ = input.size();
+        parse();
+        readFrames();
+    }
+
+    void Multiplexer::readFrames()
+    {
+        auto self = shared_from_this();
+        connection_->readSome(
+            readBuffer_.data() + readBytes_, readBuffer_.size() - readBytes_,
+            [this, self](err const &error, std::size_t bytes_transferred) {
+                if (error)
+                {
+                    fail(error);
+                    return;
+                }
+                readBytes_ += bytes_transferred;
+                parse();
+                if (throttle_ == RateLimit::Clock::duration::zero())
+                {
+                    readFrames();
+                    return;
+                }
+                RateLimit::recordDrop(RateLimit::THROTTLE,
+                                      connection_->userName());
+                resume_.expires_after(throttle_);
+                resume_.async_wait([this, self](err const &error) {
+                    if (error)
+                        fail(error);
+                    else
+                        readFrames();
+                });
+            });
+    }
+
+    void Multiplexer::parse()
+    {
+        vector<std::shared_ptr<PlayerHandler>> opened;
+        std::size_t                            pos     = 0;
+        uint64_t                               invalid = 0;
+        {
+            const lock_guard<mutex> lock(lock_);
+            for (; pos + sizeof(Frame) <= readBytes_; pos += sizeof(Frame))
+            {
+                auto frame = decodeFrame(readBuffer_.data() + pos);
+                if (!dispatch(frame, opened)) ++invalid;
+            }
+        }
+        std::memmove(readBuffer_.data(), readBuffer_.data() + pos,
+                     readBytes_ - pos);
+        readBytes_ -= pos;
+
+        auto frames = pos / sizeof(Frame);
+        throttle_   = packets_.charge(
+            RateLimit::config.packets_,
+            (frames - invalid) + invalid * RateLimit::INVALID_PACKET_COST);
+        if (invalid != 0)
+        {
+            RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                  connection_->userName(), invalid);
+        }
+
+        for (auto &player : opened) onSession_(std::move(player));
+    }
+
+    bool Multiplexer::dispatch(const Frame                            &frame,
+                               vector<std::shared_ptr<PlayerHandler>> &opened)
+    {
+        Packet packet(frame.type_, frame.data_);
+
+        if (packet.type_ == PacketType::CONN_PACKET &&
+            packet.data_ == ConnMsg::SESSION_OPEN)
+        {
+            if (sessions_.count(frame.sessionId_) != 0 ||
+                sessions_.size() >= MAX_SESSIONS)
+                return false;
+            auto player = std::make_shared<PlayerHandler>(
+                service_, shared_from_this(), frame.sessionId_,
+                connection_->userName() + "#" +
+                    std::to_string(frame.sessionId_));
+            sessions_[frame.sessionId_].player_ = player;
+            opened.push_back(std::move(player));
+            return true;
+        }
+
+        if (packet.type_ != PacketType::DATA_PACKET) return false;
+
+        auto it = sessions_.find(frame.sessionId_);
+        if (it == sessions_.end()) return false;
+
+        auto &session = it->second;
+        if (session.read_)
+        {
+            session.readBuffer_[0] = packet.type_;
+            session.readBuffer_[1] = packet.data_;
+            complete(std::move(session.read_), err(), sizeof(Packet));
+            session.read_ = nullptr;
+        }
+        else if (session.inbox_.size() < Game::MAX_POSSIBLE_MOVES)
+        {
+            // Sent ahead of the game asking for it; a plain socket would
+            // have buffered it in the kernel.
+            session.inbox_.push_back(packet);
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    void Multiplexer::send(uint32_t sessionId, Packet packet, Handler cb)
+    {
+        const lock_guard<mutex> lock(lock_);
+        if (error_)
+        {
+            complete(std::move(cb), error_, 0);
+            return;
+        }
+
+        pending_.resize(pending_.size() + sizeof(Frame));
+        encodeFrame({uint16_t(sessionId), packet.type_, packet.data_},
+                    pending_.data() + pending_.size() - sizeof(Frame));
+        pendingCbs_.push_back(std::move(cb));
+
+        // Deferred, so that the other games whose handlers are already
+        // queued add their frames to the same write.
+        if (!flushing_)
+        {
+            flushing_ = true;
+            asio::post(service_,
+                       [self = shared_from_this()] { self->flush(); });
+        }
+    }
+
+    void Multiplexer::flush()
+    {
+        const lock_guard<mutex> lock(lock_);
+        if (error_ || pending_.empty())
+        {
+            flushing_ = false;
+            return;
+        }
+        writing_.swap(pending_);
+        writingCbs_.swap(pendingCbs_);
+        ++writes_;
+        frames_ += writingCbs_.size();
+
+        auto self = shared_from_this();
+        connection_->write(
+            writing_.data(), writing_.size(),
+            [this, self](err const &error, std::size_t bytes_transferred) {
+                vector<Handler> callbacks;
+                {
+                    const lock_guard<mutex> lock(lock_);
+                    callbacks.swap(writingCbs_);
+                    writing_.clear();
+                }
+                for (auto &cb : callbacks)
+                    cb(error, error ? 0 : sizeof(Packet));
+
+                if (error)
+                    fail(error);
+                else
+                    flush();
+            });
+    }
+
+    void Multiplexer::read(uint32_t sessionId, uint8_t *buffer, Handler cb)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end())
+        {
+            complete(std::move(cb), asio::error::not_connected, 0);
+            return;
+        }
+
+        auto &session = it->second;
+        if (!session.inbox_.empty())
+        {
+            buffer[0] = session.inbox_.front().type_;
+            buffer[1] = session.inbox_.front().data_;
+            session.inbox_.pop_front();
+            complete(std::move(cb), err(), sizeof(Packet));
+        }
+        else if (error_)
+        {
+            complete(std::move(cb), error_, 0);
+        }
+        else
+        {
+            session.readBuffer_ = buffer;
+            session.read_       = std::move(cb);
+        }
+    }
+
+    void Multiplexer::cancelRead(uint32_t sessionId)
+    {
+        const lock_guard<mutex> lock(lock_);
+        auto                    it = sessions_.find(sessionId);
+        if (it == sessions_.end() || !it->second.read_) return;
+        complete(std::move(it->second.read_), asio::error::operation_aborted,
+                 0);
+        it->second.read_ = nullptr;
+    }
+
+    void Multiplexer::closeSession(uint32_t sessionId)
+    {
+        {
+            const lock_guard<mutex> lock(lock_);
+            sessions_.erase(sessionId);
+        }
+        send(sessionId,
+             Packet::create(PacketType::CONN_PACKET, ConnMsg::SESSION_CLOSE),
+             [](err const &error, std::size_t bytes_transferred) {});
+    }
+
+    // Every session player is dropped, so that the lobby does not pair it
+    // and its name is released. Sessions still in a game are closed by the
+    // game once it sees the error; the others are closed here.
+    void Multiplexer::fail(err const &error)
+    {
+        vector<Handler>                        callbacks;
+        vector<std::shared_ptr<PlayerHandler>> players;
+        {
+            const lock_guard<mutex> lock(lock_);
+            if (error_) return;
+            error_ = error;
+            for (auto it = sessions_.begin(); it != sessions_.end();)
+            {
+                auto &session = it->second;
+                if (session.read_)
+                {
+                    complete(std::move(session.read_), error_, 0);
+                    session.read_ = nullptr;
+                }
+                auto player = session.player_.lock();
+                if (player) players.push_back(player);
+                if (player && player->paired())
+                    ++it;
+                else
+                    it = sessions_.erase(it);
+            }
+            callbacks.swap(pendingCbs_);
+            pending_.clear();
+        }
+        for (auto &player : players) player->drop();
+        for (auto &cb : callbacks) cb(error, 0);
+
+        LOG_INF << "Multiplexed connection from " << connection_->userName()
+                << " closed (" << error.message() << ") after sending "
+                << frames_ << " frames in " << writes_ << " writes.";
+        connection_->close();
+    }
+
+    bool Multiplexer::finished()
+    {
+        const lock_guard<mutex> lock(lock_);
+        return error_ && sessions_.empty();
+    }
+
+    void Multiplexer::complete(Handler cb, err error, std::size_t bytes)
+    {
+        asio::post(service_, [cb, error, bytes] { cb(error, bytes); });
+    }
+} // namespace GameLib
@@ -0,0 +1,212 @@
+#ifndef DATAGRAM_HPP
+#define DATAGRAM_HPP
+
+#include <boost/asio/ip/udp.hpp>
+#include <sys/socket.h>
+#include <map>
+#include <random>
+#include <unordered_map>
+
+#include "Game.hpp"
+
+namespace GameLib
+{
+    using udp = boost::asio::ip::udp;
+
+    enum DatagramKind : uint8_t
+    {
+        HELLO = 1, // client: nonce, cookie and username, opens a session
+        WELCOME,   // server: the session id, followed by nonce and cookie
+        DATA,      // one sequenced packet
+        ACK,       // acknowledgement only, also a keepalive
+        BYE,       // client: closes the session
+        RESET      // server: the session is unknown
+    };
+
+    // Starts every datagram. `ack_` is the next sequence number the sender
+    // expects, and acknowledges everything before it.
+    struct DatagramHeader
+    {
+            uint32_t sessionId_; // 0 in HELLO
+            uint8_t  kind_;
+            uint16_t seq_;
+            uint16_t ack_;
+    } __attribute__((packed));
+
+    // On the wire the header's numbers are little endian, whatever the
+    // host's byte order.
+    inline void encodeHeader(const DatagramHeader &header, uint8_t *out)
+    {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<uint8_t>(header.sessionId_ >> (8 * i));
+        out[4] = header.kind_;
+        out[5] = static_cast<uint8_t>(header.seq_);
+        out[6] = static_cast<uint8_t>(header.seq_ >> 8);
+        out[7] = static_cast<uint8_t>(header.ack_);
+        out[8] = static_cast<uint8_t>(header.ack_ >> 8);
+    }
+
+    inline DatagramHeader decodeHeader(const uint8_t *in)
+    {
+        uint32_t sessionId = 0;
+        for (int i = 0; i < 4; ++i) sessionId |= uint32_t(in[i]) << (8 * i);
+        return DatagramHeader{sessionId, in[4],
+                              static_cast<uint16_t>(in[5] | in[6] << 8),
+                              static_cast<uint16_t>(in[7] | in[8] << 8)};
+    }
+
+    // Sequence numbers wrap around.
+    inline bool seqBefore(uint16_t a, uint16_t b)
+    {
+        return int16_t(a - b) < 0;
+    }
+
+    // Players over UDP, all on one socket bound to the server's port. A
+    // client sends HELLO with a random nonce, a cookie (0 at first) and its
+    // username until it gets WELCOME with a session id. A HELLO without the
+    // right cookie only gets WELCOME with session id 0 and the cookie, a
+    // keyed hash of the source and nonce, so nothing is kept for a source
+    // until it has shown that it receives our datagrams. The session then
+    // enters the lobby like a TCP player, without a USERNAME_REQUEST. Each DATA datagram carries one packet and is acked
+    // at once; unacked DATA is resent after a timeout derived from the
+    // measured round trip (go-back-N, since a game has at most a couple of
+    // packets in flight). Datagrams are received and sent in batches with
+    // recvmmsg and sendmmsg.
+    class DatagramTransport
+        : public Transport,
+          public std::enable_shared_from_this<DatagramTransport>
+    {
+        public:
+            using Clock = std::chrono::steady_clock;
+
+            static constexpr std::size_t     BATCH        = 32;
+            static constexpr std::size_t     MAX_SESSIONS = 1 << 16;
+            static constexpr uint8_t         MAX_RETRIES  = 8;
+            static constexpr Clock::duration MIN_RTO =
+                std::chrono::milliseconds(10);
+            static constexpr Clock::duration INITIAL_RTO =
+                std::chrono::milliseconds(100);
+            static constexpr Clock::duration MAX_RTO = std::chrono::seconds(1);
+            // Clients waiting in the lobby send ACKs to stay within it.
+            static constexpr Clock::duration IDLE_TIMEOUT =
+                std::chrono::seconds(30);
+            static constexpr std::size_t MAX_DATAGRAM_SIZE =
+                sizeof(DatagramHeader) + 2 * sizeof(uint64_t) +
+                MAX_USERNAME_LENGTH;
+
+        private:
+            struct Message
+            {
+                    uint16_t          seq_;
+                    Packet            packet_;
+                    Clock::time_point sentAt_;
+                    bool              resent_;
+            };
+
+            struct Session
+            {
+                    Session(asio::io_service &service) : retransmit_(service)
+                    {
+                    }
+
+                    udp::endpoint                peer_;
+                    uint64_t                     nonce_;
+                    std::weak_ptr<PlayerHandler> player_;
+                    RateLimit::TokenBucket       packets_;
+                    Clock::time_point            lastHeard_;
+                    bool                         closing_ = false;
+                    bool                         ackDue_  = false;
+                    // Outbound
+                    uint16_t                     nextSeq_ = 0;
+                    std::deque<Message>          unacked_;
+                    uint8_t                      retries_ = 0;
+                    Clock::duration              srtt_{};
+                    Clock::duration              rttvar_{};
+                    Clock::duration              rto_ = INITIAL_RTO;
+                    asio::steady_timer           retransmit_;
+                    bool                         armed_ = false;
+                    // Inbound
+                    uint16_t                     expected_ = 0;
+                    std::deque<Packet>           inbox_;
+                    uint8_t                     *readBuffer_ = nullptr;
+                    Handler                      read_;
+            };
+
+            // Large enough for anything the server sends.
+            using OutgoingData =
+                array<uint8_t, sizeof(DatagramHeader) + 2 * sizeof(uint64_t)>;
+
+            struct Outgoing
+            {
+                    udp::endpoint peer_;
+                    uint8_t       size_;
+                    OutgoingData  data_;
+            };
+
+            asio::io_service                                   &service_;
+            udp::socket                                         socket_;
+            asio::steady_timer                                  sweep_;
+            std::function<bool(const udp::endpoint &)>          admit_;
+            std::function<void(std::shared_ptr<PlayerHandler>)> onSession_;
+            mutex                                               lock_;
+            std::unordered_map<uint32_t, Session>               sessions_;
+            std::map<udp::endpoint, uint32_t>                   byPeer_;
+            std::mt19937                                        ids_;
+            array<uint8_t, 32>                                  cookieKey_;
+            vector<uint32_t>                                    acksDue_;
+            vector<Outgoing>                                    pending_;
+            vector<Handler>                                     pendingCbs_;
+            bool                                                flushing_;
+            // recvmmsg state, only touched by the one pending receive.
+            array<array<uint8_t, MAX_DATAGRAM_SIZE>, BATCH>     inData_;
+            array<sockaddr_storage, BATCH>                      inAddrs_;
+            array<iovec, BATCH>                                 inVecs_;
+            array<mmsghdr, BATCH>                               inMsgs_;
+
+            void receive();
+            void receiveBatch();
+            void handle(const uint8_t *data, std::size_t size,
+                        const udp::endpoint                    &peer,
+                        vector<std::shared_ptr<PlayerHandler>> &opened);
+            void hello(const uint8_t *data, std::size_t size,
+                       const udp::endpoint                    &peer,
+                       vector<std::shared_ptr<PlayerHandler>> &opened);
+            uint64_t cookie(const udp::endpoint &peer, uint64_t nonce);
+            void     welcome(const udp::endpoint &peer, uint32_t id,
+                             uint64_t nonce);
+            void acknowledge(Session &session, uint16_t ack);
+            void deliver(Session &session, uint16_t seq, Packet packet);
+            void queue(const udp::endpoint &peer, DatagramHeader header,
+                       const void *payload = nullptr, uint8_t size = 0);
+            void queueData(uint32_t id, Session &session, const Message &m);
+            void arm(uint32_t id, Session &session, Clock::time_point when);
+            void retransmit(uint32_t id);
+            void sweep();
+            void fail(uint32_t id, err error);
+            void erase(uint32_t id);
+            void scheduleFlush();
+            void flush();
+            void complete(Handler cb, err error, std::size_t bytes);
+
+        public:
+            // `admit` decides whether a new source may open a session;
+            // `onSession` is called with every newly opened session.
+            DatagramTransport(
+                asio::io_service                                   &service,
+                std::function<bool(const udp::endpoint &)>          admit,
+                std::function<void(std::shared_ptr<PlayerHandler>)> onSession);
+
+            // Binds to `port`, or adopts `fd` if it is a valid socket.
+            bool start(uint16_t port, int fd = -1);
+            void stop();
+            int  nativeHandle();
+
+            void send(uint32_t sessionId, Packet packet, Handler cb) override;
+            void read(uint32_t sessionId, uint8_t *buffer,
+                      Handler cb) override;
+            void cancelRead(uint32_t sessionId) override;
+            void closeSession(uint32_t sessionId) override;
+    };
+} // namespace GameLib
+
+#endif
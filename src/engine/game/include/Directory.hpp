@@ -0,0 +1,55 @@
+#ifndef DIRECTORY_HPP
+#define DIRECTORY_HPP
+
+#include <unordered_map>
+
+#include "Game.hpp"
+
+namespace GameLib
+{
+    // The players that are online, by username. Every operation locks one
+    // of SHARDS shards picked by the name's hash, so that connections
+    // finishing their username exchange on different worker threads rarely
+    // wait for each other. The online count is kept separately and costs a
+    // single load.
+    class PlayerDirectory
+    {
+        private:
+            struct Entry
+            {
+                    const PlayerHandler         *player_;
+                    std::weak_ptr<PlayerHandler> handle_;
+            };
+
+            struct alignas(64) Shard
+            {
+                    mutex                             lock_;
+                    std::unordered_map<string, Entry> players_;
+            };
+
+            static constexpr std::size_t SHARDS = 256;
+
+            array<Shard, SHARDS> shards_;
+            atomic<std::size_t>  online_;
+
+            Shard &shardOf(const string &userName);
+
+        public:
+            PlayerDirectory() : online_(0)
+            {
+            }
+
+            // False if another player is online under the same name.
+            bool add(const std::shared_ptr<PlayerHandler> &player);
+            // Removes `player`, but not a later player of the same name.
+            void remove(PlayerHandler &player);
+            std::shared_ptr<PlayerHandler> find(const string &userName);
+
+            std::size_t online() const
+            {
+                return online_.load(std::memory_order_relaxed);
+            }
+    };
+} // namespace GameLib
+
+#endif
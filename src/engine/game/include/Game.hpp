@@ -21,7 +21,11 @@
 #include <sstream>
 #include <list>
 
+#include "Tls.hpp"
 #include "Logger.hpp"
+#include "Tracer.hpp"
+#include "RateLimit.hpp"
+#include "Capture.hpp"
 
 namespace asio = boost::asio;
 
@@ -52,7 +56,12 @@ namespace GameLib
         PLAYER1_INDICATION,
         PLAYER2_INDICATION,
         START_SERVER,
-        SHUTDOWN_SERVER
+        SHUTDOWN_SERVER,
+        MULTIPLEX_REQUEST,
+        SESSION_OPEN,
+        SESSION_CLOSE,
+        CHALLENGE_REQUEST,
+        USERNAME_TAKEN
     };
 
     enum Move : uint8_t
@@ -137,6 +146,16 @@ namespace GameLib
                     return result + "PLAYER1_INDICATION";
                 case ConnMsg::PLAYER2_INDICATION:
                     return result + "PLAYER2_INDICATION";
+                case ConnMsg::MULTIPLEX_REQUEST:
+                    return result + "MULTIPLEX_REQUEST";
+                case ConnMsg::SESSION_OPEN:
+                    return result + "SESSION_OPEN";
+                case ConnMsg::SESSION_CLOSE:
+                    return result + "SESSION_CLOSE";
+                case ConnMsg::CHALLENGE_REQUEST:
+                    return result + "CHALLENGE_REQUEST";
+                case ConnMsg::USERNAME_TAKEN:
+                    return result + "USERNAME_TAKEN";
                 default:
                     return "INVALID_CONN_PACKET_DATA";
             }
@@ -175,67 +194,441 @@ namespace GameLib
         return "INVALID_PACKET_TYPE";
     }
 
+    // Connection state handed to a new server process on hot restart.
+    struct PlayerState
+    {
+            string userName_;
+            bool   gameReady_;
+            bool   userNameRequested_;
+            string pendingInput_; // partial username or partial move
+            string challenge_;
+    };
+
+    // Longer username lines are rejected rather than buffered.
+    constexpr std::size_t MAX_USERNAME_LENGTH = 256;
+
+    // Carries the packets of players that have no socket of their own:
+    // sessions on a multiplexed connection, or datagram sessions. Completion
+    // handlers are never invoked inline.
+    class Transport
+    {
+        public:
+            using Handler = std::function<void(err, std::size_t)>;
+
+            virtual ~Transport() = default;
+
+            virtual void send(uint32_t sessionId, Packet packet,
+                              Handler cb) = 0;
+            // Completes with the session's next packet copied to `buffer`.
+            virtual void read(uint32_t sessionId, uint8_t *buffer,
+                              Handler cb) = 0;
+            virtual void cancelRead(uint32_t sessionId)   = 0;
+            virtual void closeSession(uint32_t sessionId) = 0;
+    };
+
+    class PlayerDirectory;
+
     class PlayerHandler : public std::enable_shared_from_this<PlayerHandler>
     {
         private:
-            asio::io_service &service_;
-            tcp::socket       socket_;
-            bool              gameReady_;
-            string            userName_;
-            asio::streambuf   inputStreamBuf_;
-            std::istream      inputStream_;
-            vector<uint8_t>   inputBuffer_;
-            vector<uint8_t>   outputBuffer_;
+            asio::io_service            &service_;
+            tcp::socket                  socket_;
+            bool                         gameReady_;
+            string                       userName_;
+            asio::streambuf              inputStreamBuf_;
+            std::istream                 inputStream_;
+            vector<uint8_t>              inputBuffer_;
+            vector<uint8_t>              outputBuffer_;
+            std::size_t                  pendingBytes_;
+            mutex                        handoffLock_;
+            bool                         handoff_;
+            bool                         parked_;
+            bool                         userNameRequested_;
+            bool                         readingUserName_;
+            std::atomic<uint32_t>        writing_; // writes in flight
+            std::atomic<bool>            cancelPending_;
+            uint64_t                     readAt_; // traced read completion
+            bool                         multiplexRequested_;
+            bool                         dropped_;
+            bool                         paired_;
+            PlayerDirectory             *directory_;
+            bool                         listed_;
+            string                       challenge_;
+            uint32_t                     captureId_;
+            RateLimit::TokenBucket       packets_;
+            unique_ptr<Tls::Session>     tls_;
+            std::shared_ptr<Transport>   transport_;
+            uint32_t                     sessionId_;
+
+            void writeDone();
+
+            // Stamps the completion of a move read, before its handler runs,
+            // so that the trace can time the dispatch to the game.
+            void stampRead()
+            {
+                readAt_ = Tracing::enabled.load(std::memory_order_relaxed)
+                              ? Tracing::now()
+                              : 0;
+            }
+            void cancelPendingRead();
 
         public:
             PlayerHandler(asio::io_service &service)
                 : service_(service), socket_(service), gameReady_(false),
-                  inputStream_(&inputStreamBuf_)
+                  inputStreamBuf_(MAX_USERNAME_LENGTH),
+                  inputStream_(&inputStreamBuf_), pendingBytes_(0),
+                  handoff_(false), parked_(false), userNameRequested_(false),
+                  readingUserName_(false), writing_(0), cancelPending_(false),
+                  readAt_(0), multiplexRequested_(false),
+                  dropped_(false), paired_(false), directory_(nullptr),
+                  listed_(false), captureId_(0), sessionId_(0)
             {
                 inputBuffer_.resize(sizeof(Packet));
                 outputBuffer_.resize(sizeof(Packet));
             }
 
+            // A session opened on a multiplexed connection or over
+            // datagrams. It enters the lobby straight away.
+            PlayerHandler(asio::io_service          &service,
+                          std::shared_ptr<Transport> transport,
+                          uint32_t sessionId, const string &userName)
+                : PlayerHandler(service)
+            {
+                transport_ = std::move(transport);
+                sessionId_ = sessionId;
+                userName_  = userName;
+                gameReady_ = true;
+            }
+
+            // Adopts a connection handed off by another server process.
+            PlayerHandler(asio::io_service &service, int fd,
+                          const PlayerState &state)
+                : PlayerHandler(service)
+            {
+                socket_.assign(tcp::v4(), fd);
+                userName_          = state.userName_;
+                gameReady_         = state.gameReady_;
+                userNameRequested_ = state.userNameRequested_;
+                challenge_         = state.challenge_;
+                if (gameReady_)
+                {
+                    pendingBytes_ = std::min(state.pendingInput_.size(),
+                                             inputBuffer_.size());
+                    std::copy_n(state.pendingInput_.begin(), pendingBytes_,
+                                inputBuffer_.begin());
+                }
+                else
+                {
+                    std::ostream(&inputStreamBuf_) << state.pendingInput_;
+                }
+            }
+
+            ~PlayerHandler()
+            {
+                unlist();
+            }
+
             tcp::socket &socket()
             {
                 return socket_;
             }
 
+            string remoteAddress()
+            {
+                err  error;
+                auto endpoint = socket_.remote_endpoint(error);
+                return error ? "unknown" : endpoint.address().to_string();
+            }
+
+            // "address ,port" for the log. The peer may already be gone.
+            string remotePeer()
+            {
+                err  error;
+                auto endpoint = socket_.remote_endpoint(error);
+                if (error) return "unknown";
+                return endpoint.address().to_string() + " ," +
+                       std::to_string(endpoint.port());
+            }
+
+            bool isOpen()
+            {
+                return transport_ || socket_.is_open();
+            }
+
+            // Closes a connection that was refused, so that the lobby can
+            // forget it.
+            void drop()
+            {
+                unlist();
+                dropped_ = true;
+                err error;
+                socket_.close(error);
+            }
+
+            bool dropped()
+            {
+                return dropped_;
+            }
+
+            // Charges the player's packet bucket; false once it is empty.
+            bool allowPacket(bool valid)
+            {
+                return packets_.consume(
+                    RateLimit::config.packets_,
+                    valid ? 1 : RateLimit::INVALID_PACKET_COST);
+            }
+
+            // The username is registered in `directory`, which turns away
+            // a second player of the same name.
+            void useDirectory(PlayerDirectory &directory)
+            {
+                directory_ = &directory;
+            }
+
+            // False if the name is taken.
+            bool list();
+            void unlist();
+            // Tells the player its name is taken and closes the connection.
+            void rejectUserName();
+
+            // A username line prefixed with {CONN_PACKET, MULTIPLEX_REQUEST}
+            // turns the connection into a multiplexed one. The prefix cannot
+            // start a UTF-8 name. A name followed by {CONN_PACKET,
+            // CHALLENGE_REQUEST} and another player's name waits for a game
+            // against that player only.
             void setUserName()
             {
                 std::getline(inputStream_, userName_);
+                if (userName_.size() >= sizeof(Packet) &&
+                    uint8_t(userName_[0]) == PacketType::CONN_PACKET &&
+                    uint8_t(userName_[1]) == ConnMsg::MULTIPLEX_REQUEST)
+                {
+                    userName_.erase(0, sizeof(Packet));
+                    multiplexRequested_ = true;
+                    return;
+                }
+
+                const char challenge[] = {char(PacketType::CONN_PACKET),
+                                          char(ConnMsg::CHALLENGE_REQUEST)};
+                auto       separator =
+                    userName_.find(challenge, 0, sizeof(challenge));
+                if (separator != string::npos)
+                {
+                    challenge_ =
+                        userName_.substr(separator + sizeof(challenge));
+                    userName_.resize(separator);
+                }
+
+                if (!list())
+                {
+                    rejectUserName();
+                    return;
+                }
+                startCapture();
                 gameReady_ = true;
             }
 
+            bool multiplexRequested()
+            {
+                return multiplexRequested_;
+            }
+
             bool gameReady()
             {
                 return (gameReady_ == true);
             }
 
+            // The name of the only player this one wants to play, if any.
+            const string &challenge()
+            {
+                return challenge_;
+            }
+
+            // Set once the player has been given a game.
+            void pair()
+            {
+                paired_ = true;
+            }
+
+            bool paired()
+            {
+                return paired_;
+            }
+
             string &userName()
             {
                 return userName_;
             }
 
+            // Records the player's packets from here on, if capture is on.
+            // Handed off players are not recorded, as their sessions began
+            // in another process.
+            void startCapture()
+            {
+                captureId_ = Capture::open(userName_);
+            }
+
+            uint32_t captureId()
+            {
+                return captureId_;
+            }
+
             void sendMsg(Packet                                packet,
                          std::function<void(err, std::size_t)> cb)
             {
                 // LOG_INF << "Sending packet: " << to_string(packet);
+                if (captureId_ != 0)
+                {
+                    uint8_t data[] = {packet.type_, packet.data_};
+                    Capture::record(captureId_, Capture::OUT, data,
+                                    sizeof(data));
+                }
+                if (transport_)
+                {
+                    transport_->send(sessionId_, packet, std::move(cb));
+                    return;
+                }
                 outputBuffer_[0] = packet.type_;
                 outputBuffer_[1] = packet.data_;
-                asio::async_write(
-                    socket_, asio::buffer(outputBuffer_, sizeof(Packet)), cb);
+                writing_.fetch_add(1);
+                auto done = [this, cb = std::move(cb)](err const  &error,
+                                                       std::size_t bytes) {
+                    writeDone();
+                    cb(error, bytes);
+                };
+                if (tls_)
+                {
+                    tls_->asyncWrite(outputBuffer_.data(), sizeof(Packet),
+                                     std::move(done));
+                    return;
+                }
+                asio::async_write(socket_,
+                                  asio::buffer(outputBuffer_, sizeof(Packet)),
+                                  std::move(done));
             }
 
             void readString(std::function<void(err, std::size_t)> cb)
             {
+                if (tls_)
+                {
+                    tls_->asyncReadUntil(inputStreamBuf_, '\n', cb);
+                    return;
+                }
                 asio::async_read_until(socket_, inputStreamBuf_, '\n', cb);
             }
 
+            // Bytes of a move received before a read was cancelled are kept
+            // in inputBuffer_, and the next read only asks for the rest.
             void readMove(std::function<void(err, std::size_t)> cb)
             {
-                asio::async_read(socket_, asio::buffer(inputBuffer_),
-                                 asio::transfer_exactly(sizeof(Packet)), cb);
+                if (captureId_ != 0)
+                {
+                    cb = [this, cb](err const &error, std::size_t bytes) {
+                        if (!error)
+                            Capture::record(captureId_, Capture::IN,
+                                            inputBuffer_.data(),
+                                            sizeof(Packet));
+                        else if (error != asio::error::operation_aborted)
+                            Capture::record(captureId_, Capture::HANGUP);
+                        cb(error, bytes);
+                    };
+                }
+                auto remaining = sizeof(Packet) - pendingBytes_;
+                auto done = [this, cb](err const  &error,
+                                       std::size_t bytes_transferred) {
+                    stampRead();
+                    // A cancel still waiting for writes came too late.
+                    cancelPending_.store(false);
+                    bytes_transferred += pendingBytes_;
+                    pendingBytes_ = error ? bytes_transferred : 0;
+                    cb(error, bytes_transferred);
+                };
+                if (transport_)
+                {
+                    transport_->read(
+                        sessionId_, inputBuffer_.data(),
+                        [this, cb](err const &error, std::size_t bytes) {
+                            stampRead();
+                            cb(error, bytes);
+                        });
+                    return;
+                }
+                if (tls_)
+                {
+                    tls_->asyncRead(inputBuffer_.data() + pendingBytes_,
+                                    remaining, done);
+                    return;
+                }
+                asio::async_read(
+                    socket_,
+                    asio::buffer(inputBuffer_.data() + pendingBytes_, remaining),
+                    asio::transfer_exactly(remaining), done);
+            }
+
+            // Raw stream access for the Multiplexer that takes over this
+            // connection once it has asked to be multiplexed.
+            void readSome(uint8_t *data, std::size_t size,
+                          std::function<void(err, std::size_t)> cb)
+            {
+                if (tls_)
+                {
+                    tls_->asyncReadSome(data, size, cb);
+                    return;
+                }
+                socket_.async_read_some(asio::buffer(data, size), cb);
+            }
+
+            void write(const uint8_t *data, std::size_t size,
+                       std::function<void(err, std::size_t)> cb)
+            {
+                if (tls_)
+                {
+                    tls_->asyncWrite(data, size, cb);
+                    return;
+                }
+                asio::async_write(socket_, asio::buffer(data, size), cb);
+            }
+
+            // Bytes that arrived together with the username line.
+            vector<uint8_t> takeBufferedInput()
+            {
+                auto            data = inputStreamBuf_.data();
+                vector<uint8_t> input(asio::buffers_begin(data),
+                                      asio::buffers_end(data));
+                inputStreamBuf_.consume(input.size());
+                return input;
+            }
+
+            // Cancels an outstanding read, which then completes with
+            // operation_aborted. Writes in flight are left to complete.
+            void cancelRead();
+            // Closes the socket, or ends the session on its transport.
+            void close();
+
+            void startTls(std::function<void(err)> cb)
+            {
+                tls_ = make_unique<Tls::Session>(socket_);
+                tls_->asyncHandshake(cb);
+            }
+
+            // A TLS connection can only move to another process when the
+            // kernel holds its record state. Multiplexed and datagram
+            // sessions share their socket and are never handed off.
+            bool handoffSupported()
+            {
+                return !transport_ && !multiplexRequested_ &&
+                       (!tls_ || tls_->kernelOffload());
+            }
+
+            uint8_t packetType()
+            {
+                return inputBuffer_[0];
+            }
+
+            // When the last move read completed, or 0 if it was not traced.
+            uint64_t readCompletedAt() const
+            {
+                return readAt_;
             }
 
             uint8_t getMove()
@@ -254,39 +647,104 @@ namespace GameLib
                     Packet::create(PacketType::CONN_PACKET,
                                    ConnMsg::USERNAME_REQUEST),
                     [this](err const &error, std::size_t bytes_transferred) {
-                        LOG_DBG
-                            << "Successfully sent username request("
-                            << bytes_transferred << " bytes) to ("
-                            << socket_.remote_endpoint().address().to_string()
-                            << " ,"
-                            << std::to_string(socket_.remote_endpoint().port())
-                            << ").";
-
-                        readString([this](err const  &error,
-                                          std::size_t bytes_transferred) {
-                            if (error)
-                            {
-                                LOG_ERR << "Error during reception of "
-                                           "username: "
-                                        << error.message();
-                            }
-                            else
-                            {
-                                LOG_DBG << "Received username from ("
-                                        << socket_.remote_endpoint()
-                                               .address()
-                                               .to_string()
-                                        << " ,"
-                                        << std::to_string(
-                                               socket_.remote_endpoint().port())
-                                        << ")."
-                                        << "read: " << bytes_transferred
-                                        << " bytes.";
-                                setUserName();
-                            }
-                        });
+                        LOG_DBG << "Successfully sent username request("
+                                << bytes_transferred << " bytes) to ("
+                                << remotePeer() << ").";
+                        userNameRequested_ = !error;
+                        readUserName();
                     });
             }
+
+            void readUserName()
+            {
+                const lock_guard<mutex> lock(handoffLock_);
+                if (handoff_)
+                {
+                    parked_ = true;
+                    return;
+                }
+                readingUserName_ = true;
+                readString([this](err const  &error,
+                                  std::size_t bytes_transferred) {
+                    {
+                        const lock_guard<mutex> lock(handoffLock_);
+                        readingUserName_ = false;
+                        if (handoff_ && error == asio::error::operation_aborted)
+                        {
+                            parked_ = true;
+                            return;
+                        }
+                    }
+                    if (error == asio::error::not_found)
+                    {
+                        // No newline within MAX_USERNAME_LENGTH bytes.
+                        RateLimit::recordDrop(RateLimit::INVALID_PACKET,
+                                              remoteAddress());
+                        drop();
+                    }
+                    else if (error)
+                    {
+                        LOG_ERR << "Error during reception of "
+                                   "username: "
+                                << error.message();
+                        drop();
+                    }
+                    else
+                    {
+                        LOG_DBG << "Received username from ("
+                                << remotePeer() << ")."
+                                << "read: " << bytes_transferred
+                                << " bytes.";
+                        setUserName();
+                    }
+                });
+            }
+
+            // Continues the username exchange of a handed off connection.
+            void resumeUserName()
+            {
+                if (gameReady_) return;
+                if (userNameRequested_)
+                    readUserName();
+                else
+                    getUserName();
+            }
+
+            // Stops the username exchange at the next safe point so that the
+            // connection can be handed to another process. Players that are
+            // already in a game are handed off through Game instead.
+            void requestHandoff()
+            {
+                const lock_guard<mutex> lock(handoffLock_);
+                handoff_ = true;
+                if (readingUserName_) cancelRead();
+            }
+
+            // True once no operation is in flight on this connection.
+            bool handoffReady()
+            {
+                const lock_guard<mutex> lock(handoffLock_);
+                return gameReady_ || parked_ || multiplexRequested_;
+            }
+
+            PlayerState saveState()
+            {
+                PlayerState state{userName_, gameReady_, userNameRequested_,
+                                  "", challenge_};
+                if (gameReady_)
+                {
+                    state.pendingInput_.assign(inputBuffer_.begin(),
+                                               inputBuffer_.begin() +
+                                                   pendingBytes_);
+                }
+                else
+                {
+                    auto data = inputStreamBuf_.data();
+                    state.pendingInput_.assign(asio::buffers_begin(data),
+                                               asio::buffers_end(data));
+                }
+                return state;
+            }
     };
 
     enum PlayerIdentifer : uint8_t
@@ -295,10 +753,20 @@ namespace GameLib
         X = 1
     };
 
-    class Game
+    using Board = std::array<std::array<uint8_t, 3>, 3>;
+
+    // A game parked between moves, handed to a new server process on hot
+    // restart together with the sockets of both players.
+    struct GameState
     {
-            using Board = std::array<std::array<uint8_t, 3>, 3>;
+            Board           board_;
+            uint8_t         moveCount_;
+            PlayerIdentifer awaiting_;
+            PlayerState     player1_, player2_;
+    };
 
+    class Game
+    {
         private:
             Board                          board_;
             std::shared_ptr<PlayerHandler> player1_, player2_;
@@ -306,31 +774,58 @@ namespace GameLib
             uint8_t                        moveCount_;
             GameResult                     gameResult_;
             bool                           gameOver_;
+            uint64_t                       traceId_;
+            mutex                          handoffLock_;
+            bool                           reading_;
+            bool                           handoff_;
+            bool                           parked_;
+            PlayerIdentifer                awaiting_;
+
+            bool moveReadCancelled(err const &error);
+            bool moveAccepted(PlayerIdentifer id);
+            void forfeit(PlayerIdentifer id);
 
         public:
             static constexpr uint8_t EMPTY              = 2;
             static constexpr uint8_t MAX_POSSIBLE_MOVES = 9;
             Game(std::shared_ptr<PlayerHandler> &player1,
                  std::shared_ptr<PlayerHandler> &player2)
+                : reading_(false), handoff_(false), parked_(false),
+                  awaiting_(PlayerIdentifer::X)
             {
                 player1_ = std::move(player1);
                 player2_ = std::move(player2);
-                for (auto &row : board_)
-                {
-                    std::fill(row.begin(), row.end(), EMPTY);
-                }
-                moveCount_ = 0;
-                gameOver_  = false;
+                resetBoard();
+                gameOver_ = false;
+                traceId_  = 0;
                 setup();
             }
+            // Resumes a game handed off by another server process.
+            Game(std::shared_ptr<PlayerHandler> &player1,
+                 std::shared_ptr<PlayerHandler> &player2,
+                 const GameState                &state)
+                : reading_(false), handoff_(false), parked_(false),
+                  awaiting_(state.awaiting_)
+            {
+                player1_   = std::move(player1);
+                player2_   = std::move(player2);
+                board_     = state.board_;
+                moveCount_ = state.moveCount_;
+                gameOver_  = false;
+                traceId_   = 0;
+                LOG_INF << "Game resumed between " << player1_->userName()
+                        << " and " << player2_->userName();
+                readMove(awaiting_);
+            }
             ~Game()
             {
-                player1_->socket().close();
-                player2_->socket().close();
+                player1_->close();
+                player2_->close();
                 LOG_DBG << "~Game called.";
             }
             void setup();
             void start();
+            void resetBoard();
             void readMove(PlayerIdentifer id);
             void sendMove(PlayerIdentifer id, uint8_t move, bool finalMove);
             void updateBoard(PlayerIdentifer id, uint8_t move);
@@ -338,6 +833,19 @@ namespace GameLib
             void sendResultToPlayers(uint8_t move);
             GameResult checkResult();
             bool       gameOver();
+            void       requestHandoff();
+            bool       parked();
+            GameState  saveState();
+
+            std::shared_ptr<PlayerHandler> &player1()
+            {
+                return player1_;
+            }
+
+            std::shared_ptr<PlayerHandler> &player2()
+            {
+                return player2_;
+            }
     };
 } // namespace GameLib
 
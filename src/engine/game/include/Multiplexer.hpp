@@ -0,0 +1,103 @@
+#ifndef MULTIPLEXER_HPP
+#define MULTIPLEXER_HPP
+
+#include <unordered_map>
+
+#include "Game.hpp"
+
+namespace GameLib
+{
+    // Everything sent on a multiplexed connection: the usual packet,
+    // prefixed with the session it belongs to.
+    struct Frame
+    {
+            uint16_t sessionId_;
+            uint8_t  type_;
+            uint8_t  data_;
+    } __attribute__((packed));
+
+    // On the wire the session id is little endian, whatever the host's
+    // byte order.
+    inline void encodeFrame(const Frame &frame, uint8_t *out)
+    {
+        out[0] = static_cast<uint8_t>(frame.sessionId_);
+        out[1] = static_cast<uint8_t>(frame.sessionId_ >> 8);
+        out[2] = frame.type_;
+        out[3] = frame.data_;
+    }
+
+    inline Frame decodeFrame(const uint8_t *in)
+    {
+        return Frame{static_cast<uint16_t>(in[0] | in[1] << 8), in[2], in[3]};
+    }
+
+    // Carries many concurrent games over one connection. The client opens
+    // sessions with {id, CONN_PACKET, SESSION_OPEN}; each session enters
+    // the lobby as a player of its own. Once its game is over the server
+    // sends {id, CONN_PACKET, SESSION_CLOSE}, after which the id can be
+    // opened again. Frames queued by any of the connection's games while a
+    // write is pending go out in the next write. Every frame is charged to
+    // the connection's packet bucket; reading pauses while it is in debt.
+    class Multiplexer : public Transport,
+                        public std::enable_shared_from_this<Multiplexer>
+    {
+        private:
+            struct Session
+            {
+                    std::deque<Packet>           inbox_;
+                    uint8_t                     *readBuffer_ = nullptr;
+                    Handler                      read_;
+                    std::weak_ptr<PlayerHandler> player_;
+            };
+
+            asio::io_service                                   &service_;
+            std::shared_ptr<PlayerHandler>                      connection_;
+            std::function<void(std::shared_ptr<PlayerHandler>)> onSession_;
+            mutex                                               lock_;
+            std::unordered_map<uint16_t, Session>               sessions_;
+            vector<uint8_t>                                     readBuffer_;
+            std::size_t                                         readBytes_;
+            vector<uint8_t>                                     pending_;
+            vector<Handler>                                     pendingCbs_;
+            vector<uint8_t>                                     writing_;
+            vector<Handler>                                     writingCbs_;
+            bool                                                flushing_;
+            err                                                 error_;
+            atomic<uint64_t>                                    writes_;
+            atomic<uint64_t>                                    frames_;
+            RateLimit::TokenBucket                              packets_;
+            RateLimit::Clock::duration                          throttle_;
+            asio::steady_timer                                  resume_;
+
+            void readFrames();
+            void parse();
+            // False if the frame was ignored.
+            bool dispatch(const Frame &frame,
+                          vector<std::shared_ptr<PlayerHandler>> &opened);
+            void flush();
+            void fail(err const &error);
+            void complete(Handler cb, err error, std::size_t bytes);
+
+        public:
+            static constexpr std::size_t READ_BUFFER_SIZE = 4096;
+            static constexpr std::size_t MAX_SESSIONS     = 4096;
+
+            // `onSession` is called with every newly opened session.
+            Multiplexer(asio::io_service              &service,
+                        std::shared_ptr<PlayerHandler> connection,
+                        std::function<void(std::shared_ptr<PlayerHandler>)>
+                            onSession);
+
+            void start();
+            void send(uint32_t sessionId, Packet packet, Handler cb) override;
+            void read(uint32_t sessionId, uint8_t *buffer,
+                      Handler cb) override;
+            void cancelRead(uint32_t sessionId) override;
+            void closeSession(uint32_t sessionId) override;
+
+            // True once the connection has failed and no session is left.
+            bool finished();
+    };
+} // namespace GameLib
+
+#endif
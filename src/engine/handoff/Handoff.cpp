@@ -0,0 +1,295 @@
+#include "Handoff.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Handoff
+{
+    namespace
+    {
+        bool makeAddress(const string &path, sockaddr_un &address)
+        {
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                errno = ENAMETOOLONG;
+                return false;
+            }
+            std::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            std::memcpy(address.sun_path, path.c_str(), path.size());
+            return true;
+        }
+
+        // Sockets and game state are only exchanged with our own user.
+        bool sameUser(int sock)
+        {
+            ucred     credentials{};
+            socklen_t size = sizeof(credentials);
+            if (::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials,
+                             &size) < 0)
+                return false;
+            if (credentials.uid != ::getuid())
+            {
+                errno = EACCES;
+                return false;
+            }
+            return true;
+        }
+
+        void closeKeepingErrno(int sock)
+        {
+            int error = errno;
+            ::close(sock);
+            errno = error;
+        }
+
+        void putString(vector<uint8_t> &out, const string &value)
+        {
+            auto size = static_cast<uint16_t>(
+                std::min<size_t>(value.size(), UINT16_MAX));
+            out.push_back(size & 0xff);
+            out.push_back(size >> 8);
+            out.insert(out.end(), value.begin(), value.begin() + size);
+        }
+
+        bool getByte(const vector<uint8_t> &in, size_t &pos, uint8_t &value)
+        {
+            if (pos >= in.size()) return false;
+            value = in[pos++];
+            return true;
+        }
+
+        bool getString(const vector<uint8_t> &in, size_t &pos, string &value)
+        {
+            uint8_t low, high;
+            if (!getByte(in, pos, low) || !getByte(in, pos, high)) return false;
+            size_t size = low | (high << 8);
+            if (pos + size > in.size()) return false;
+            value.assign(in.begin() + pos, in.begin() + pos + size);
+            pos += size;
+            return true;
+        }
+
+        void putPlayer(vector<uint8_t> &out, const PlayerState &state)
+        {
+            out.push_back(state.gameReady_);
+            out.push_back(state.userNameRequested_);
+            putString(out, state.userName_);
+            putString(out, state.pendingInput_);
+        }
+
+        bool getPlayer(const vector<uint8_t> &in, size_t &pos,
+                       PlayerState &state)
+        {
+            uint8_t ready, requested;
+            if (!getByte(in, pos, ready) || !getByte(in, pos, requested))
+                return false;
+            state.gameReady_         = ready;
+            state.userNameRequested_ = requested;
+            return getString(in, pos, state.userName_) &&
+                   getString(in, pos, state.pendingInput_);
+        }
+    } // namespace
+
+    string socketPath(uint16_t port)
+    {
+        return "/tmp/multithreaded_server." + std::to_string(port) + ".sock";
+    }
+
+    int listen(const string &path)
+    {
+        sockaddr_un address;
+        if (!makeAddress(path, address)) return -1;
+
+        int sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock < 0) return -1;
+
+        ::unlink(path.c_str());
+        if (::bind(sock, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) < 0 ||
+            ::chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0 ||
+            ::listen(sock, 1) < 0)
+        {
+            closeKeepingErrno(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    int connect(const string &path)
+    {
+        sockaddr_un address;
+        if (!makeAddress(path, address)) return -1;
+
+        int sock = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock < 0) return -1;
+
+        if (::connect(sock, reinterpret_cast<sockaddr *>(&address),
+                      sizeof(address)) < 0 ||
+            !sameUser(sock))
+        {
+            closeKeepingErrno(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    int accept(int listener)
+    {
+        int sock = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) return -1;
+        if (!sameUser(sock))
+        {
+            closeKeepingErrno(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    bool send(int sock, const Message &message)
+    {
+        if (message.fds_.size() > MAX_FDS ||
+            message.payload_.size() + 1 > MAX_MESSAGE_SIZE)
+        {
+            errno = EMSGSIZE;
+            return false;
+        }
+
+        vector<uint8_t> data;
+        data.reserve(message.payload_.size() + 1);
+        data.push_back(message.type_);
+        data.insert(data.end(), message.payload_.begin(),
+                    message.payload_.end());
+
+        iovec  iov{data.data(), data.size()};
+        msghdr header{};
+        header.msg_iov    = &iov;
+        header.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        if (!message.fds_.empty())
+        {
+            auto fdBytes          = sizeof(int) * message.fds_.size();
+            header.msg_control    = control;
+            header.msg_controllen = CMSG_SPACE(fdBytes);
+
+            cmsghdr *cmsg    = CMSG_FIRSTHDR(&header);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(fdBytes);
+            std::memcpy(CMSG_DATA(cmsg), message.fds_.data(), fdBytes);
+        }
+
+        ssize_t sent;
+        do
+        {
+            sent = ::sendmsg(sock, &header, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        return sent == static_cast<ssize_t>(data.size());
+    }
+
+    bool receive(int sock, Message &message)
+    {
+        vector<uint8_t> data(MAX_MESSAGE_SIZE);
+        iovec           iov{data.data(), data.size()};
+        msghdr          header{};
+        header.msg_iov    = &iov;
+        header.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+        header.msg_control    = control;
+        header.msg_controllen = sizeof(control);
+
+        ssize_t received;
+        do
+        {
+            received = ::recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+        } while (received < 0 && errno == EINTR);
+        if (received <= 0) return false;
+
+        message.fds_.clear();
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+             cmsg          = CMSG_NXTHDR(&header, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            auto fds   = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+            message.fds_.insert(message.fds_.end(), fds, fds + count);
+        }
+
+        if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        {
+            for (int fd : message.fds_) ::close(fd);
+            errno = EMSGSIZE;
+            return false;
+        }
+
+        message.type_ = static_cast<MessageType>(data[0]);
+        message.payload_.assign(data.begin() + 1, data.begin() + received);
+        return true;
+    }
+
+    vector<uint8_t> encode(const PlayerState &state)
+    {
+        vector<uint8_t> out;
+        putPlayer(out, state);
+        putString(out, state.challenge_);
+        return out;
+    }
+
+    vector<uint8_t> encode(const GameState &state)
+    {
+        vector<uint8_t> out;
+        for (auto const &row : state.board_)
+            out.insert(out.end(), row.begin(), row.end());
+        out.push_back(state.moveCount_);
+        out.push_back(state.awaiting_);
+        putPlayer(out, state.player1_);
+        putPlayer(out, state.player2_);
+        return out;
+    }
+
+    bool decode(const vector<uint8_t> &payload, PlayerState &state)
+    {
+        size_t pos = 0;
+        if (!getPlayer(payload, pos, state)) return false;
+        // Servers that predate challenges do not send one.
+        if (pos == payload.size()) return true;
+        return getString(payload, pos, state.challenge_) &&
+               pos == payload.size();
+    }
+
+    // Every cell must be empty or hold a mark, and the move count must match
+    // the marks on the board.
+    bool decode(const vector<uint8_t> &payload, GameState &state)
+    {
+        size_t  pos   = 0;
+        uint8_t marks = 0;
+        for (auto &row : state.board_)
+        {
+            for (auto &cell : row)
+            {
+                if (!getByte(payload, pos, cell)) return false;
+                if (cell != PlayerIdentifer::O && cell != PlayerIdentifer::X &&
+                    cell != Game::EMPTY)
+                    return false;
+                if (cell != Game::EMPTY) ++marks;
+            }
+        }
+
+        uint8_t awaiting;
+        if (!getByte(payload, pos, state.moveCount_) ||
+            !getByte(payload, pos, awaiting) || state.moveCount_ != marks ||
+            (awaiting != PlayerIdentifer::O && awaiting != PlayerIdentifer::X))
+            return false;
+        state.awaiting_ = static_cast<PlayerIdentifer>(awaiting);
+        return getPlayer(payload, pos, state.player1_) &&
+               getPlayer(payload, pos, state.player2_) &&
+               pos == payload.size();
+    }
+} // namespace Handoff
@@ -0,0 +1,50 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include "Game.hpp"
+
+// Hot restart: a new server process connects to the running one over a
+// Unix domain socket and receives the listening socket, then the sockets of
+// waiting players and running games (passed with SCM_RIGHTS) together with
+// their serialized state.
+namespace Handoff
+{
+    using namespace GameLib;
+
+    enum MessageType : uint8_t
+    {
+        TAKEOVER_REQUEST = 1,
+        ACCEPTOR,
+        PLAYER,
+        GAME,
+        DONE
+    };
+
+    struct Message
+    {
+            MessageType     type_;
+            vector<int>     fds_;
+            vector<uint8_t> payload_;
+    };
+
+    constexpr size_t MAX_MESSAGE_SIZE = 1 << 16;
+    constexpr size_t MAX_FDS          = 2;
+
+    string socketPath(uint16_t port);
+
+    // Thin wrappers around SOCK_SEQPACKET Unix sockets. They return -1 or
+    // false on failure with errno set. Both ends of a connection must run as
+    // the same user; accept() and connect() fail with EACCES otherwise.
+    int  listen(const string &path);
+    int  connect(const string &path);
+    int  accept(int listener);
+    bool send(int sock, const Message &message);
+    bool receive(int sock, Message &message);
+
+    vector<uint8_t> encode(const PlayerState &state);
+    vector<uint8_t> encode(const GameState &state);
+    bool            decode(const vector<uint8_t> &payload, PlayerState &state);
+    bool            decode(const vector<uint8_t> &payload, GameState &state);
+} // namespace Handoff
+
+#endif
@@ -1,19 +1,41 @@
 #ifndef SERVER_HPP
 #define SERVER_HPP
 
-#include "Game.hpp"
+#include <future>
+#include "Handoff.hpp"
+#include "Multiplexer.hpp"
+#include "Datagram.hpp"
+#include "Directory.hpp"
 
 using namespace Logging;
 using namespace GameLib;
 
 constexpr uint16_t DEFAULT_PORT           = 9000;
 constexpr uint16_t THREAD_COUNT           = 5;
+constexpr uint16_t MAXIMUM_THREAD_COUNT   = 1024;
 constexpr uint16_t MAXIMUM_NUM_OF_PLAYERS = 10000;
+constexpr uint32_t DEFAULT_SPIN_BUDGET    = 20000;
+constexpr auto     HANDOFF_DRAIN_TIMEOUT  = std::chrono::seconds(5);
 
+// How worker threads wait for handlers. BLOCKING parks them in run() until
+// work arrives. BUSY_POLL spins on poll_one() for up to the spin budget
+// before parking in run_one(), trading CPU for wakeup latency.
+enum WorkerPolicy : uint8_t
+{
+    BLOCKING,
+    BUSY_POLL
+};
+
+using WorkGuard = asio::executor_work_guard<asio::io_service::executor_type>;
+
+// Elements are inserted from any thread, but the list is walked and modified
+// by one owner thread only. Inserts wait aside until the owner adopts them,
+// so that the list never changes behind an iterator.
 template <class T> class TS_List
 {
     private:
         std::list<std::shared_ptr<T>> list_;
+        std::list<std::shared_ptr<T>> inserted_;
         mutex                         listLock_;
 
     public:
@@ -26,12 +48,19 @@ template <class T> class TS_List
         void insert(std::shared_ptr<T> handler)
         {
             const lock_guard<mutex> lock(listLock_);
-            list_.push_back(handler);
+            inserted_.push_back(std::move(handler));
         }
 
-        listIter remove(listIter it)
+        // Moves the elements inserted since the last call to the end of the
+        // list. Owner only, like the members below.
+        void adopt()
         {
             const lock_guard<mutex> lock(listLock_);
+            list_.splice(list_.end(), inserted_);
+        }
+
+        listIter remove(listIter it)
+        {
             return list_.erase(it);
         }
 
@@ -90,28 +119,73 @@ class TS_Queue
 class Server
 {
     private:
-        uint16_t               port_;
-        uint16_t               threadCount_;
-        vector<thread>         threadPool_;
-        asio::io_service       io_service_;
-        tcp::acceptor          acceptor_;
-        TS_List<PlayerHandler> clientHandlers_;
-        TS_List<Game>          runningGames_;
-        volatile bool          shutDownCommand_;
+        // First, so that it outlives every PlayerHandler.
+        PlayerDirectory          directory_;
+        uint16_t                 port_;
+        uint16_t                 threadCount_;
+        vector<thread>           threadPool_;
+        asio::io_service         io_service_;
+        WorkerPolicy             policy_;
+        uint32_t                 spinBudget_;
+        WorkGuard                workGuard_;
+        asio::io_service::strand acceptStrand_;
+        tcp::acceptor            acceptor_;
+        asio::signal_set         signals_;
+        TS_List<PlayerHandler>   clientHandlers_;
+        TS_List<Game>            runningGames_;
+        TS_List<Multiplexer>     multiplexers_;
+        RateLimit::Table         acceptLimits_;
+        bool                     datagramsEnabled_;
+        volatile bool            shutDownCommand_;
+        int                      handoffListener_;
+        atomic<int>              takeoverPeer_;
+        thread                   handoffThread_;
+
+        std::shared_ptr<DatagramTransport> datagrams_;
+
+        bool takeOver(int &peer, int &datagramFd);
+        bool startDatagrams(int fd);
+        void receiveSessions(int peer);
+        void startHandoffListener();
+        bool handOff(int peer);
+        bool handoffDrained();
+        void runWorker();
+        // Lists a player that arrived with its name, such as a session on a
+        // multiplexed connection, and lets it wait for a game.
+        void enterLobby(std::shared_ptr<PlayerHandler> player);
 
     public:
-        Server(uint16_t threadCount = 1)
-            : threadCount_(threadCount), acceptor_(io_service_),
-              shutDownCommand_(false)
+        Server(uint16_t threadCount = 1, WorkerPolicy policy = BLOCKING,
+               uint32_t spinBudget = DEFAULT_SPIN_BUDGET)
+            : threadCount_(threadCount), policy_(policy),
+              spinBudget_(spinBudget),
+              workGuard_(asio::make_work_guard(io_service_)),
+              acceptStrand_(io_service_),
+              acceptor_(io_service_), signals_(io_service_, SIGUSR1),
+              datagramsEnabled_(false), shutDownCommand_(false),
+              handoffListener_(-1), takeoverPeer_(-1)
         {
         }
 
-        void startServer(uint16_t port);
+        // With `takeover` set, the listening socket and live sessions are
+        // taken from the server already running on `port` (hot restart).
+        // Logs through whatever initLogger() has set up.
+        void startServer(uint16_t port, bool takeover = false);
+        // Also serves players over UDP on the same port; call before
+        // startServer().
+        void enableDatagrams();
+        // CPU time used by the worker threads so far.
+        std::chrono::nanoseconds workerCpuTime();
+        // Players online, in the lobby or in a game.
+        std::size_t playersOnline();
+        void acceptConnection();
         void handleNewConnection(const std::shared_ptr<PlayerHandler> &handler,
                                  err const                            &error);
         void startGame(std::shared_ptr<PlayerHandler> &player1,
                        std::shared_ptr<PlayerHandler> &player2);
         void startClientProcessor();
+        void waitForSignal();
+        void stopServer();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include "Tls.hpp"
+
+#include <boost/asio/ssl/error.hpp>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <cerrno>
+
+#include "Logger.hpp"
+
+namespace Tls
+{
+    namespace
+    {
+        SSL_CTX *context_ = nullptr;
+
+        SSL_CTX *createContext()
+        {
+            SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+            if (ctx == nullptr) return nullptr;
+
+            SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+            SSL_CTX_set1_groups_list(ctx, "X25519:P-256");
+
+            // Resumption: stateless tickets (one per connection is enough
+            // for a player to reconnect) plus the server-side session cache
+            // for TLS 1.2 session ids.
+            static const unsigned char sessionContext[] = "multithreaded_server";
+            SSL_CTX_set_session_id_context(ctx, sessionContext,
+                                           sizeof(sessionContext) - 1);
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_set_num_tickets(ctx, 1);
+
+            // Idle players should not pin read/write buffers.
+            SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_ENABLE_KTLS
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+            return ctx;
+        }
+
+        void logSslError(const char *what)
+        {
+            char buffer[256];
+            ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+            LOG_ERR << what << ": " << buffer;
+        }
+    } // namespace
+
+    bool init(const std::string &certFile, const std::string &keyFile)
+    {
+        SSL_CTX *ctx = createContext();
+        if (ctx == nullptr ||
+            SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(),
+                                        SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1)
+        {
+            logSslError("Failed to set up TLS");
+            SSL_CTX_free(ctx);
+            return false;
+        }
+        context_ = ctx;
+        return true;
+    }
+
+    bool initSelfSigned()
+    {
+        SSL_CTX  *ctx  = createContext();
+        EVP_PKEY *key  = EVP_EC_gen("P-256");
+        X509     *cert = X509_new();
+        bool      ok   = ctx != nullptr && key != nullptr && cert != nullptr;
+
+        if (ok)
+        {
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+            X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600);
+            X509_set_pubkey(cert, key);
+
+            X509_NAME *name = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(
+                name, "CN", MBSTRING_ASC,
+                reinterpret_cast<const unsigned char *>("localhost"), -1, -1,
+                0);
+            X509_set_issuer_name(cert, name);
+
+            ok = X509_sign(cert, key, EVP_sha256()) > 0 &&
+                 SSL_CTX_use_certificate(ctx, cert) == 1 &&
+                 SSL_CTX_use_PrivateKey(ctx, key) == 1;
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        if (!ok)
+        {
+            logSslError("Failed to create a self-signed certificate");
+            SSL_CTX_free(ctx);
+            return false;
+        }
+        context_ = ctx;
+        return true;
+    }
+
+    bool enabled()
+    {
+        return context_ != nullptr;
+    }
+
+    Session::Session(tcp::socket &socket)
+        : socket_(socket), ssl_(SSL_new(context_)), kernelSend_(false),
+          kernelRecv_(false)
+    {
+        socket_.non_blocking(true);
+        SSL_set_fd(ssl_, socket_.native_handle());
+    }
+
+    Session::~Session()
+    {
+        SSL_free(ssl_);
+    }
+
+    err Session::lastError(int result)
+    {
+        switch (SSL_get_error(ssl_, result))
+        {
+            case SSL_ERROR_ZERO_RETURN:
+                return asio::error::eof;
+            case SSL_ERROR_SYSCALL:
+                if (errno != 0)
+                    return err(errno, boost::system::system_category());
+                return asio::error::eof;
+            default:
+                return err(static_cast<int>(ERR_get_error()),
+                           asio::error::get_ssl_category());
+        }
+    }
+
+    bool Session::wait(int result, std::function<void(err)> retry)
+    {
+        switch (SSL_get_error(ssl_, result))
+        {
+            case SSL_ERROR_WANT_READ:
+                socket_.async_wait(tcp::socket::wait_read, retry);
+                return true;
+            case SSL_ERROR_WANT_WRITE:
+                socket_.async_wait(tcp::socket::wait_write, retry);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Like asio, never invoke a completion handler from inside the
+    // initiating call; callers may hold locks around it.
+    void Session::complete(Handler cb, err error, std::size_t bytes)
+    {
+        asio::post(socket_.get_executor(),
+                   [cb, error, bytes] { cb(error, bytes); });
+    }
+
+    void Session::asyncHandshake(std::function<void(err)> cb)
+    {
+        handshake(std::move(cb));
+    }
+
+    void Session::handshake(std::function<void(err)> cb)
+    {
+        const std::lock_guard<std::mutex> lock(sslLock_);
+        int result = SSL_accept(ssl_);
+        if (result == 1)
+        {
+#ifdef BIO_get_ktls_send
+            kernelSend_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+            kernelRecv_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#endif
+            LOG_DBG << "TLS handshake done (resumed: "
+                    << SSL_session_reused(ssl_) << ", kTLS tx/rx: "
+                    << kernelSend_ << "/" << kernelRecv_ << ").";
+            complete([cb](err error, std::size_t) { cb(error); }, err(), 0);
+            return;
+        }
+
+        auto retry = [this, cb](err const &error) {
+            if (error)
+                cb(error);
+            else
+                handshake(cb);
+        };
+        if (!wait(result, retry))
+        {
+            complete([cb](err error, std::size_t) { cb(error); },
+                     lastError(result), 0);
+        }
+    }
+
+    void Session::asyncWrite(const uint8_t *data, std::size_t size,
+                             Handler cb)
+    {
+        if (kernelSend_)
+        {
+            asio::async_write(socket_, asio::buffer(data, size), cb);
+            return;
+        }
+        writeSome(data, size, 0, std::move(cb));
+    }
+
+    void Session::writeSome(const uint8_t *data, std::size_t size,
+                            std::size_t done, Handler cb)
+    {
+        const std::lock_guard<std::mutex> lock(sslLock_);
+        while (done < size)
+        {
+            int result = SSL_write(ssl_, data + done, size - done);
+            if (result > 0)
+            {
+                done += result;
+                continue;
+            }
+
+            auto retry = [this, data, size, done, cb](err const &error) {
+                if (error)
+                    cb(error, done);
+                else
+                    writeSome(data, size, done, cb);
+            };
+            if (!wait(result, retry)) complete(cb, lastError(result), done);
+            return;
+        }
+        complete(cb, err(), done);
+    }
+
+    void Session::asyncRead(uint8_t *data, std::size_t size, Handler cb)
+    {
+        if (kernelRecv_)
+        {
+            asio::async_read(socket_, asio::buffer(data, size),
+                             asio::transfer_exactly(size), cb);
+            return;
+        }
+        readSome(data, size, 0, std::move(cb));
+    }
+
+    void Session::readSome(uint8_t *data, std::size_t size, std::size_t done,
+                           Handler cb)
+    {
+        const std::lock_guard<std::mutex> lock(sslLock_);
+        while (done < size)
+        {
+            int result = SSL_read(ssl_, data + done, size - done);
+            if (result > 0)
+            {
+                done += result;
+                continue;
+            }
+
+            auto retry = [this, data, size, done, cb](err const &error) {
+                if (error)
+                    cb(error, done);
+                else
+                    readSome(data, size, done, cb);
+            };
+            if (!wait(result, retry)) complete(cb, lastError(result), done);
+            return;
+        }
+        complete(cb, err(), done);
+    }
+
+    void Session::asyncReadSome(uint8_t *data, std::size_t size, Handler cb)
+    {
+        if (kernelRecv_)
+        {
+            socket_.async_read_some(asio::buffer(data, size), cb);
+            return;
+        }
+
+        const std::lock_guard<std::mutex> lock(sslLock_);
+        int result = SSL_read(ssl_, data, size);
+        if (result > 0)
+        {
+            complete(cb, err(), result);
+            return;
+        }
+
+        auto retry = [this, data, size, cb](err const &error) {
+            if (error)
+                cb(error, 0);
+            else
+                asyncReadSome(data, size, cb);
+        };
+        if (!wait(result, retry)) complete(cb, lastError(result), 0);
+    }
+
+    void Session::asyncReadUntil(asio::streambuf &buffer, char delimiter,
+                                 Handler cb)
+    {
+        if (kernelRecv_)
+        {
+            asio::async_read_until(socket_, buffer, delimiter, cb);
+            return;
+        }
+        readUntil(buffer, delimiter, buffer.size(), std::move(cb));
+    }
+
+    // Reads one byte at a time: SSL_read then only copies out of the
+    // decrypted record, and bytes after the delimiter (e.g. the first move)
+    // stay in OpenSSL for the next asyncRead. Like asio::async_read_until,
+    // a full buffer without the delimiter completes with not_found.
+    void Session::readUntil(asio::streambuf &buffer, char delimiter,
+                            std::size_t done, Handler cb)
+    {
+        const std::lock_guard<std::mutex> lock(sslLock_);
+        while (true)
+        {
+            if (buffer.size() >= buffer.max_size())
+            {
+                complete(cb, asio::error::not_found, done);
+                return;
+            }
+
+            char byte;
+            int  result = SSL_read(ssl_, &byte, 1);
+            if (result > 0)
+            {
+                buffer.sputn(&byte, 1);
+                ++done;
+                if (byte == delimiter) break;
+                continue;
+            }
+
+            auto retry = [this, &buffer, delimiter, done,
+                          cb](err const &error) {
+                if (error)
+                    cb(error, done);
+                else
+                    readUntil(buffer, delimiter, done, cb);
+            };
+            if (!wait(result, retry)) complete(cb, lastError(result), done);
+            return;
+        }
+        complete(cb, err(), done);
+    }
+} // namespace Tls
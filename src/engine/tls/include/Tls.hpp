@@ -0,0 +1,74 @@
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <boost/asio.hpp>
+#include <openssl/ssl.h>
+#include <functional>
+#include <mutex>
+#include <string>
+
+// Optional TLS for player connections. OpenSSL runs directly on the socket
+// (rather than through asio::ssl's memory BIOs) so that, where the kernel
+// supports it, the record layer is offloaded with kTLS after the handshake
+// and the steady-state path is a plain socket read or write. Session tickets
+// let reconnecting players resume without a full handshake.
+namespace Tls
+{
+    namespace asio = boost::asio;
+
+    using tcp     = boost::asio::ip::tcp;
+    using err     = boost::system::error_code;
+    using Handler = std::function<void(err, std::size_t)>;
+
+    // Sets up the server-wide context from PEM files, or from a freshly
+    // generated self-signed P-256 certificate. Return false on failure.
+    bool init(const std::string &certFile, const std::string &keyFile);
+    bool initSelfSigned();
+    bool enabled();
+
+    class Session
+    {
+        private:
+            tcp::socket &socket_;
+            SSL         *ssl_;
+            std::mutex   sslLock_;
+            bool         kernelSend_;
+            bool         kernelRecv_;
+
+            // Waits for the socket to become ready as requested by the
+            // result of the last SSL call. Returns false on a hard error.
+            bool wait(int result, std::function<void(err)> retry);
+            err  lastError(int result);
+            void complete(Handler cb, err error, std::size_t bytes);
+
+            void handshake(std::function<void(err)> cb);
+            void writeSome(const uint8_t *data, std::size_t size,
+                           std::size_t done, Handler cb);
+            void readSome(uint8_t *data, std::size_t size, std::size_t done,
+                          Handler cb);
+            void readUntil(asio::streambuf &buffer, char delimiter,
+                           std::size_t done, Handler cb);
+
+        public:
+            Session(tcp::socket &socket);
+            ~Session();
+
+            void asyncHandshake(std::function<void(err)> cb);
+            void asyncWrite(const uint8_t *data, std::size_t size, Handler cb);
+            // Completes once exactly `size` bytes have been read.
+            void asyncRead(uint8_t *data, std::size_t size, Handler cb);
+            // Completes as soon as any bytes have been read.
+            void asyncReadSome(uint8_t *data, std::size_t size, Handler cb);
+            void asyncReadUntil(asio::streambuf &buffer, char delimiter,
+                                Handler cb);
+
+            // True when the kernel handles the record layer both ways, so
+            // the socket carries no userspace TLS state.
+            bool kernelOffload() const
+            {
+                return kernelSend_ && kernelRecv_;
+            }
+    };
+} // namespace Tls
+
+#endif
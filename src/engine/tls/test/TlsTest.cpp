@@ -0,0 +1,102 @@
+#include "Tls.hpp"
+
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Regression tests for Tls::Session, run by ctest. Each case returns an
+// empty string on success, or what went wrong.
+namespace
+{
+    namespace asio = boost::asio;
+
+    using tcp = boost::asio::ip::tcp;
+    using err = boost::system::error_code;
+
+    // Connects a blocking OpenSSL client to `port` and writes `line`.
+    void sendOverTls(uint16_t port, const std::string &line)
+    {
+        asio::io_service service;
+        tcp::socket      socket(service);
+        socket.connect({asio::ip::address_v4::loopback(), port});
+
+        SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+        SSL     *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, socket.native_handle());
+        if (SSL_connect(ssl) == 1)
+        {
+            SSL_write(ssl, line.data(), static_cast<int>(line.size()));
+            // Wait for the server to close the connection.
+            char byte;
+            SSL_read(ssl, &byte, 1);
+        }
+        SSL_free(ssl);
+        SSL_CTX_free(ctx);
+    }
+
+    // A line longer than the streambuf allows used to make sputn() throw
+    // std::length_error on a worker thread. It must complete with
+    // not_found, as asio::async_read_until does on a plain socket.
+    std::string overlongLine()
+    {
+        constexpr std::size_t MAX_LINE = 256;
+
+        asio::io_service service;
+        tcp::acceptor    acceptor(service, {asio::ip::address_v4::loopback(),
+                                            0});
+        tcp::socket      socket(service);
+        std::thread      client(sendOverTls, acceptor.local_endpoint().port(),
+                                std::string(400, 'a') + "\n");
+        acceptor.accept(socket);
+
+        Tls::Session    session(socket);
+        asio::streambuf buffer(MAX_LINE);
+        err             result;
+        bool            completed = false;
+        session.asyncHandshake([&](err const &error) {
+            if (error)
+            {
+                result    = error;
+                completed = true;
+                return;
+            }
+            session.asyncReadUntil(buffer, '\n',
+                                   [&](err const &error, std::size_t) {
+                                       result    = error;
+                                       completed = true;
+                                   });
+        });
+
+        std::string failure;
+        try
+        {
+            service.run();
+        }
+        catch (const std::exception &e)
+        {
+            failure = std::string("threw ") + e.what();
+        }
+        socket.close();
+        client.join();
+
+        if (!failure.empty()) return failure;
+        if (!completed) return "did not complete";
+        if (result != asio::error::not_found)
+            return "completed with " + result.message();
+        if (buffer.size() > MAX_LINE) return "overran the buffer";
+        return "";
+    }
+} // namespace
+
+int main()
+{
+    if (!Tls::initSelfSigned()) return 1;
+
+    auto failure = overlongLine();
+    if (!failure.empty())
+    {
+        std::cerr << "overlongLine: " << failure << "\n";
+        return 1;
+    }
+    return 0;
+}
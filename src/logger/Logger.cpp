@@ -4,15 +4,24 @@ namespace Logging
 {
     shared_ptr<sink_t> sink;
 
-    void initLogger(string fileName, bool auto_flush)
+    void initLogger(string fileName, bool auto_flush, bool append)
     {
         try
         {
-            shared_ptr<std::ostream> strm(new std::ofstream(fileName.c_str()));
+            shared_ptr<std::ostream> strm(new std::ofstream(
+                fileName.c_str(), append ? std::ios::app : std::ios::trunc));
             if (!strm->good())
             {
                 throw std::runtime_error("Failed to open a text log file");
             }
+            boost::shared_ptr<logging::core> core = logging::core::get();
+            if (sink)
+            {
+                // Re-initialising replaces the previous log file.
+                sink->flush();
+                core->remove_sink(sink);
+            }
+
             shared_ptr<backend_t> backend = boost::make_shared<backend_t>();
             backend->auto_flush(auto_flush);
             sink = boost::make_shared<sink_t>(
@@ -23,12 +32,10 @@ namespace Logging
             sink->set_formatter(
                 expr::format("[%1%] [%2%] <%3%> : %4%") %
                 expr::format_date_time<boost::posix_time::ptime>(
-                    "TimeStamp", "%H:%M:%S.%f") %
+                    "TimeStamp", "%Y-%m-%d %H:%M:%S.%f") %
                 expr::attr<attrs::current_thread_id::value_type>("ThreadID") %
                 logging::trivial::severity % expr::smessage);
 
-            boost::shared_ptr<logging::core> core = logging::core::get();
-
             core->add_sink(sink);
             core->add_global_attribute("TimeStamp", attrs::local_clock());
             core->add_global_attribute("ThreadID", attrs::current_thread_id());
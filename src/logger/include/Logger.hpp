@@ -48,6 +48,7 @@ BOOST_LOG_INLINE_GLOBAL_LOGGER_DEFAULT(
 
 #define LOG_INF BOOST_LOG_SEV(lg, INFO)
 #define LOG_DBG BOOST_LOG_SEV(lg, DEBUG)
+#define LOG_WRN BOOST_LOG_SEV(lg, WARN)
 #define LOG_ERR BOOST_LOG_SEV(lg, ERR)
 
 namespace Logging
@@ -59,7 +60,8 @@ namespace Logging
             logging::attribute_value_ordering<uint16_t, std::less<uint16_t>>>>
                               sink_t;
     extern shared_ptr<sink_t> sink;
-    void                      initLogger(string fileName, bool auto_flush);
+    void                      initLogger(string fileName, bool auto_flush,
+                                         bool append = false);
     void                      flushLogs();
 } // namespace Logging
 #endif
\ No newline at end of file
@@ -0,0 +1,326 @@
+#include "LogTool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+
+namespace LogTool
+{
+    namespace
+    {
+        // Reads exactly `width` digits starting at `pos`.
+        bool readNumber(const string &text, size_t &pos, size_t width,
+                        int64_t &value)
+        {
+            if (pos + width > text.size()) return false;
+            value = 0;
+            for (size_t i = 0; i < width; ++i)
+            {
+                char c = text[pos + i];
+                if (!std::isdigit(static_cast<unsigned char>(c))) return false;
+                value = value * 10 + (c - '0');
+            }
+            pos += width;
+            return true;
+        }
+
+        bool expect(const string &text, size_t &pos, char c)
+        {
+            if (pos >= text.size() || text[pos] != c) return false;
+            ++pos;
+            return true;
+        }
+
+        // Days since 1970-01-01 in the proleptic Gregorian calendar.
+        int64_t daysFromCivil(int64_t y, int64_t m, int64_t d)
+        {
+            y -= m <= 2;
+            const int64_t era = (y >= 0 ? y : y - 399) / 400;
+            const int64_t yoe = y - era * 400;
+            const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+            const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+            return era * 146097 + doe - 719468;
+        }
+
+        bool isWordChar(char c)
+        {
+            return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        }
+    } // namespace
+
+    Severity parseSeverity(const string &name)
+    {
+        if (name == "trace") return Severity::TRACE;
+        if (name == "debug") return Severity::DEBUG;
+        if (name == "info") return Severity::INFO;
+        if (name == "warning") return Severity::WARNING;
+        if (name == "error") return Severity::ERROR;
+        if (name == "fatal") return Severity::FATAL;
+        return Severity::UNKNOWN;
+    }
+
+    string to_string(Severity severity)
+    {
+        switch (severity)
+        {
+            case Severity::TRACE:
+                return "trace";
+            case Severity::DEBUG:
+                return "debug";
+            case Severity::INFO:
+                return "info";
+            case Severity::WARNING:
+                return "warning";
+            case Severity::ERROR:
+                return "error";
+            case Severity::FATAL:
+                return "fatal";
+            default:
+                return "unknown";
+        }
+    }
+
+    bool parseTimestamp(const string &text, int64_t &timestamp, bool &hasDate)
+    {
+        size_t  pos = 0;
+        int64_t days = 0, year, month, day, hours, minutes, seconds;
+
+        hasDate = text.size() > 4 && text[4] == '-';
+        if (hasDate)
+        {
+            if (!readNumber(text, pos, 4, year) || !expect(text, pos, '-') ||
+                !readNumber(text, pos, 2, month) || !expect(text, pos, '-') ||
+                !readNumber(text, pos, 2, day) || !expect(text, pos, ' '))
+                return false;
+            days = daysFromCivil(year, month, day);
+        }
+
+        if (!readNumber(text, pos, 2, hours) || !expect(text, pos, ':') ||
+            !readNumber(text, pos, 2, minutes) || !expect(text, pos, ':') ||
+            !readNumber(text, pos, 2, seconds))
+            return false;
+
+        int64_t micros = 0;
+        if (expect(text, pos, '.'))
+        {
+            int64_t scale = MICROS_PER_SECOND;
+            while (pos < text.size() &&
+                   std::isdigit(static_cast<unsigned char>(text[pos])))
+            {
+                scale /= 10;
+                micros += (text[pos++] - '0') * scale;
+            }
+        }
+        if (pos != text.size()) return false;
+
+        timestamp = days * MICROS_PER_DAY +
+                    ((hours * 60 + minutes) * 60 + seconds) * MICROS_PER_SECOND +
+                    micros;
+        return true;
+    }
+
+    bool parseRecord(const string &line, Record &record, bool &hasDate)
+    {
+        if (line.empty() || line[0] != '[') return false;
+        auto timeEnd = line.find(']');
+        if (timeEnd == string::npos) return false;
+        if (!parseTimestamp(line.substr(1, timeEnd - 1), record.timestamp_,
+                            hasDate))
+            return false;
+
+        auto threadBegin = line.find('[', timeEnd);
+        auto threadEnd   = line.find(']', threadBegin);
+        if (threadBegin == string::npos || threadEnd == string::npos)
+            return false;
+        record.threadId_ =
+            line.substr(threadBegin + 1, threadEnd - threadBegin - 1);
+
+        auto severityBegin = line.find('<', threadEnd);
+        auto severityEnd   = line.find('>', severityBegin);
+        if (severityBegin == string::npos || severityEnd == string::npos)
+            return false;
+        record.severity_ = parseSeverity(
+            line.substr(severityBegin + 1, severityEnd - severityBegin - 1));
+
+        auto separator = line.find(" : ", severityEnd);
+        record.messageOffset_ =
+            (separator == string::npos) ? line.size() : separator + 3;
+        return true;
+    }
+
+    Source::Source(const string &path, size_t windowSize)
+        : in_(path), windowSize_(std::max<size_t>(windowSize, 1)),
+          sequence_(0), dayOffset_(0), lastTimestamp_(0)
+    {
+    }
+
+    void Source::fill()
+    {
+        string line;
+        while (window_.size() < windowSize_ && std::getline(in_, line))
+        {
+            Record record;
+            bool   hasDate = false;
+            if (parseRecord(line, record, hasDate))
+            {
+                if (!hasDate)
+                {
+                    record.timestamp_ += dayOffset_;
+                    if (record.timestamp_ + MICROS_PER_DAY / 2 < lastTimestamp_)
+                    {
+                        dayOffset_ += MICROS_PER_DAY;
+                        record.timestamp_ += MICROS_PER_DAY;
+                    }
+                    else if (dayOffset_ > 0 &&
+                             record.timestamp_ >
+                                 lastTimestamp_ + MICROS_PER_DAY / 2)
+                    {
+                        // A late line from before the rollover.
+                        record.timestamp_ -= MICROS_PER_DAY;
+                    }
+                }
+                lastTimestamp_ = std::max(lastTimestamp_, record.timestamp_);
+            }
+            else
+            {
+                // Continuation of a multi-line message: keep it next to the
+                // line it belongs to.
+                record.timestamp_     = lastTimestamp_;
+                record.severity_      = Severity::UNKNOWN;
+                record.messageOffset_ = 0;
+            }
+            record.sequence_ = sequence_++;
+            record.line_     = std::move(line);
+            window_.push(std::move(record));
+        }
+    }
+
+    bool Source::next(Record &record)
+    {
+        fill();
+        if (window_.empty()) return false;
+        // priority_queue only exposes a const top(); the element is popped
+        // straight away, so moving from it is safe.
+        record = std::move(const_cast<Record &>(window_.top()));
+        window_.pop();
+        return true;
+    }
+
+    Merger::Merger(const vector<string> &paths, size_t windowSize)
+    {
+        for (auto const &path : paths)
+        {
+            sources_.push_back(std::make_unique<Source>(path, windowSize));
+            if (!sources_.back()->is_open())
+                throw std::runtime_error("Failed to open log file: " + path);
+
+            Head head{{}, sources_.size() - 1};
+            if (sources_.back()->next(head.record_))
+                heads_.push(std::move(head));
+        }
+    }
+
+    bool Merger::next(Record &record)
+    {
+        if (heads_.empty()) return false;
+        Head head = heads_.top();
+        heads_.pop();
+        record = std::move(head.record_);
+        if (sources_[head.source_]->next(head.record_))
+            heads_.push(std::move(head));
+        return true;
+    }
+
+    bool Filter::matches(const Record &record) const
+    {
+        if (record.severity_ < minSeverity_ &&
+            record.severity_ != Severity::UNKNOWN)
+            return false;
+        if (!threadId_.empty() && record.threadId_ != threadId_) return false;
+
+        // Bounds without a date apply to the time of day.
+        auto timeOfDay = record.timestamp_ % MICROS_PER_DAY;
+        auto key       = [&](bool hasDate) {
+            return hasDate ? record.timestamp_ : timeOfDay;
+        };
+        if (hasFrom_ && hasTo_ && !fromHasDate_ && !toHasDate_ && from_ > to_)
+        {
+            // Time-of-day range across midnight, e.g. 23:00 to 01:00.
+            if (timeOfDay < from_ && timeOfDay > to_) return false;
+        }
+        else
+        {
+            if (hasFrom_ && key(fromHasDate_) < from_) return false;
+            if (hasTo_ && key(toHasDate_) > to_) return false;
+        }
+
+        if (!player_.empty())
+        {
+            auto const &line = record.line_;
+            auto        pos  = line.find(player_, record.messageOffset_);
+            while (pos != string::npos)
+            {
+                auto end = pos + player_.size();
+                if ((pos == 0 || !isWordChar(line[pos - 1])) &&
+                    (end == line.size() || !isWordChar(line[end])))
+                    return true;
+                pos = line.find(player_, pos + 1);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void Stats::add(const Record &record)
+    {
+        if (total_ == 0) first_ = record.timestamp_;
+        last_ = record.timestamp_;
+        ++total_;
+        ++bySeverity_[record.severity_];
+
+        auto message = record.line_.c_str() + record.messageOffset_;
+        if (std::strncmp(message, "Incoming connection", 19) == 0)
+            ++connections_;
+        if (std::strncmp(message, "Game started", 12) == 0)
+        {
+            ++games_;
+            auto second = record.timestamp_ / MICROS_PER_SECOND;
+            if (second != currentSecond_)
+            {
+                currentSecond_   = second;
+                gamesThisSecond_ = 0;
+            }
+            peakGamesPerSecond_ =
+                std::max(peakGamesPerSecond_, ++gamesThisSecond_);
+        }
+    }
+
+    void Stats::write(std::ostream &out) const
+    {
+        double seconds = double(last_ - first_) / MICROS_PER_SECOND;
+        auto   rate    = [&](uint64_t count) {
+            return seconds > 0 ? count / seconds : 0.0;
+        };
+        auto errors = bySeverity_[Severity::ERROR] + bySeverity_[Severity::FATAL];
+
+        out << std::fixed << std::setprecision(3);
+        out << "records:            " << total_ << "\n";
+        out << "duration (s):       " << seconds << "\n";
+        for (uint8_t s = Severity::TRACE; s <= Severity::UNKNOWN; ++s)
+        {
+            if (bySeverity_[s] == 0) continue;
+            out << std::left << std::setw(20)
+                << ("  " + to_string(static_cast<Severity>(s)) + ":")
+                << bySeverity_[s] << "\n";
+        }
+        out << "connections:        " << connections_ << "\n";
+        out << "games:              " << games_ << "\n";
+        out << "games/s:            " << rate(games_) << "\n";
+        out << "peak games/s:       " << peakGamesPerSecond_ << "\n";
+        out << "errors/s:           " << rate(errors) << "\n";
+        out << "error rate:         "
+            << (total_ ? double(errors) / total_ : 0.0) << "\n";
+    }
+} // namespace LogTool
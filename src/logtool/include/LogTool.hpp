@@ -0,0 +1,159 @@
+#ifndef LOGTOOL_HPP
+#define LOGTOOL_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace LogTool
+{
+    using std::string, std::vector;
+
+    constexpr int64_t MICROS_PER_SECOND = 1000000;
+    constexpr int64_t MICROS_PER_DAY    = 86400 * MICROS_PER_SECOND;
+
+    enum Severity : uint8_t
+    {
+        TRACE,
+        DEBUG,
+        INFO,
+        WARNING,
+        ERROR,
+        FATAL,
+        UNKNOWN
+    };
+
+    Severity parseSeverity(const string &name);
+    string   to_string(Severity severity);
+
+    // One line of server.log:
+    //   [<date> <time>] [<thread id>] <severity> : <message>
+    // Older logs carry only the time of day.
+    struct Record
+    {
+            int64_t  timestamp_; // microseconds
+            uint64_t sequence_;  // input order, keeps the merge stable
+            Severity severity_;
+            string   threadId_;
+            string   line_;
+            size_t   messageOffset_;
+
+            string message() const
+            {
+                return line_.substr(messageOffset_);
+            }
+    };
+
+    // Parses the fixed prefix of a log line. `hasDate` tells whether the
+    // timestamp was absolute or a time of day only.
+    bool parseRecord(const string &line, Record &record, bool &hasDate);
+
+    // Parses "YYYY-MM-DD HH:MM:SS[.ffffff]" or "HH:MM:SS[.ffffff]".
+    bool parseTimestamp(const string &text, int64_t &timestamp, bool &hasDate);
+
+    struct LaterRecord
+    {
+            bool operator()(const Record &a, const Record &b) const
+            {
+                if (a.timestamp_ != b.timestamp_)
+                    return a.timestamp_ > b.timestamp_;
+                return a.sequence_ > b.sequence_;
+            }
+    };
+
+    // Streams one log file in timestamp order. The asynchronous sink may
+    // write records of different threads slightly out of order, so lines
+    // pass through a reorder window of at most `windowSize` records. Logs
+    // without dates are assumed to roll over to the next day whenever the
+    // time of day jumps back by more than twelve hours.
+    class Source
+    {
+        private:
+            std::ifstream in_;
+            std::priority_queue<Record, vector<Record>, LaterRecord> window_;
+            size_t   windowSize_;
+            uint64_t sequence_;
+            int64_t  dayOffset_;
+            int64_t  lastTimestamp_;
+
+            void fill();
+
+        public:
+            Source(const string &path, size_t windowSize);
+
+            bool is_open() const
+            {
+                return in_.is_open();
+            }
+
+            bool next(Record &record);
+    };
+
+    // k-way merge of several sources; holds one record per source plus
+    // each source's reorder window.
+    class Merger
+    {
+        private:
+            struct Head
+            {
+                    Record record_;
+                    size_t source_;
+            };
+
+            struct LaterHead
+            {
+                    bool operator()(const Head &a, const Head &b) const
+                    {
+                        return LaterRecord()(a.record_, b.record_);
+                    }
+            };
+
+            vector<std::unique_ptr<Source>>                    sources_;
+            std::priority_queue<Head, vector<Head>, LaterHead> heads_;
+
+        public:
+            // Throws std::runtime_error if a file cannot be opened.
+            Merger(const vector<string> &paths, size_t windowSize);
+            bool next(Record &record);
+    };
+
+    struct Filter
+    {
+            Severity minSeverity_ = Severity::TRACE;
+            string   threadId_;
+            string   player_;
+            bool     hasFrom_     = false;
+            bool     hasTo_       = false;
+            bool     fromHasDate_ = false;
+            bool     toHasDate_   = false;
+            int64_t  from_        = 0;
+            int64_t  to_          = 0;
+
+            bool matches(const Record &record) const;
+    };
+
+    // Single-pass summary of the merged stream.
+    class Stats
+    {
+        private:
+            uint64_t bySeverity_[Severity::UNKNOWN + 1] = {};
+            uint64_t total_                            = 0;
+            uint64_t games_                            = 0;
+            uint64_t connections_                      = 0;
+            int64_t  first_                            = 0;
+            int64_t  last_                             = 0;
+            int64_t  currentSecond_                    = -1;
+            uint64_t gamesThisSecond_                  = 0;
+            uint64_t peakGamesPerSecond_               = 0;
+
+        public:
+            void add(const Record &record);
+            void write(std::ostream &out) const;
+    };
+} // namespace LogTool
+
+#endif
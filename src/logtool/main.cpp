@@ -0,0 +1,141 @@
+#include "LogTool.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+
+using namespace LogTool;
+
+namespace
+{
+    void usage()
+    {
+        std::cerr
+            << "Usage: logtool [--severity LEVEL] [--thread ID] "
+               "[--player NAME]\n"
+               "               [--from TIME] [--to TIME] [--window N] "
+               "[--stats] FILE...\n"
+               "TIME is \"YYYY-MM-DD HH:MM:SS[.ffffff]\" or "
+               "\"HH:MM:SS[.ffffff]\".\n";
+    }
+
+    // Parses all of `text` as a positive count.
+    bool parseCount(const char *text, size_t &value)
+    {
+        if (!std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+        char *end = nullptr;
+        errno     = 0;
+        auto parsed = std::strtoull(text, &end, 10);
+        if (*end != '\0' || errno != 0 || parsed == 0 || parsed > SIZE_MAX)
+            return false;
+        value = static_cast<size_t>(parsed);
+        return true;
+    }
+
+    // An upper bound without fractional seconds covers the whole second.
+    bool parseBound(const char *text, bool upper, bool &has, bool &hasDate,
+                    int64_t &bound)
+    {
+        has = parseTimestamp(text, bound, hasDate);
+        if (!has)
+        {
+            std::cerr << "Invalid time: " << text << "\n";
+            return false;
+        }
+        if (upper && string(text).find('.') == string::npos)
+            bound += MICROS_PER_SECOND - 1;
+        return true;
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Filter         filter;
+    vector<string> paths;
+    size_t         windowSize = 4096;
+    bool           statsOnly  = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--stats")
+        {
+            statsOnly = true;
+            continue;
+        }
+        if (arg.rfind("--", 0) != 0)
+        {
+            paths.push_back(arg);
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            usage();
+            return 1;
+        }
+
+        const char *value = argv[++i];
+        if (arg == "--severity")
+            filter.minSeverity_ = parseSeverity(value);
+        else if (arg == "--thread")
+            filter.threadId_ = value;
+        else if (arg == "--player")
+            filter.player_ = value;
+        else if (arg == "--window")
+        {
+            if (!parseCount(value, windowSize))
+            {
+                std::cerr << "Invalid window: " << value << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--from")
+        {
+            if (!parseBound(value, false, filter.hasFrom_,
+                            filter.fromHasDate_, filter.from_))
+                return 1;
+        }
+        else if (arg == "--to")
+        {
+            if (!parseBound(value, true, filter.hasTo_, filter.toHasDate_,
+                            filter.to_))
+                return 1;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (paths.empty() || filter.minSeverity_ == Severity::UNKNOWN)
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        std::ios::sync_with_stdio(false);
+        Merger merger(paths, windowSize);
+        Stats  stats;
+        Record record;
+
+        while (merger.next(record))
+        {
+            if (!filter.matches(record)) continue;
+            if (statsOnly)
+                stats.add(record);
+            else
+                std::cout << record.line_ << '\n';
+        }
+        if (statsOnly) stats.write(std::cout);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -1,10 +1,144 @@
 #include "Server.hpp"
 
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+namespace
+{
+    void usage()
+    {
+        std::cerr
+            << "Usage: MultiThreaded_Server [port] [--threads N] "
+               "[--poll block|busy] [--spin N]\n"
+               "       [--takeover] [--trace FILE] [--trace-sample N]\n"
+               "       [--tls-cert PEM --tls-key PEM | --tls-self-signed]\n"
+               "       [--accept-rate N] [--packet-rate N] [--udp] "
+               "[--capture FILE]\n";
+    }
+
+    // Parses all of `text` as an integer within [min, max].
+    template <class T>
+    bool parseInteger(const char *text, uint64_t min, uint64_t max, T &value)
+    {
+        if (!std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+        char *end = nullptr;
+        errno     = 0;
+        auto parsed = std::strtoull(text, &end, 10);
+        if (*end != '\0' || errno != 0 || parsed < min || parsed > max)
+            return false;
+        value = static_cast<T>(parsed);
+        return true;
+    }
+
+    // Parses a rate in events per second; 0 disables the limit.
+    bool parseRate(const char *text, RateLimit::Limit &limit)
+    {
+        char *end = nullptr;
+        errno     = 0;
+        auto rate = std::strtod(text, &end);
+        if (end == text || *end != '\0' || errno != 0 || !std::isfinite(rate) ||
+            rate < 0)
+            return false;
+        limit = RateLimit::perSecond(rate);
+        return true;
+    }
+} // namespace
+
 int main(int argc, char *argv[])
 {
-    uint16_t           port   = (argc > 1) ? std::stoi(argv[1]) : DEFAULT_PORT;
-    unique_ptr<Server> server = make_unique<Server>(THREAD_COUNT);
-    server->startServer(port);
+    uint16_t     port        = DEFAULT_PORT;
+    uint16_t     threadCount = THREAD_COUNT;
+    WorkerPolicy policy      = WorkerPolicy::BLOCKING;
+    uint32_t     spinBudget  = DEFAULT_SPIN_BUDGET;
+    bool         takeover    = false;
+    string       traceFile   = "";
+    uint32_t     traceSample = 100;
+    string       tlsCert     = "";
+    string       tlsKey      = "";
+    bool         tlsSelfSign = false;
+    bool         datagrams   = false;
+    string       captureFile = "";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        bool   ok  = true;
+        if (arg == "--takeover")
+            takeover = true;
+        else if (arg == "--tls-self-signed")
+            tlsSelfSign = true;
+        else if (arg == "--udp")
+            datagrams = true;
+        else if (arg.rfind("--", 0) == 0)
+        {
+            // Every other option takes a value.
+            if (i + 1 == argc)
+            {
+                std::cerr << "Missing value for " << arg << "\n";
+                usage();
+                return 1;
+            }
+            const char *value = argv[++i];
+            if (arg == "--threads")
+                ok = parseInteger(value, 1, MAXIMUM_THREAD_COUNT, threadCount);
+            else if (arg == "--poll")
+            {
+                ok     = string(value) == "block" || string(value) == "busy";
+                policy = (string(value) == "busy") ? WorkerPolicy::BUSY_POLL
+                                                   : WorkerPolicy::BLOCKING;
+            }
+            else if (arg == "--spin")
+                ok = parseInteger(value, 0, UINT32_MAX, spinBudget);
+            else if (arg == "--tls-cert")
+                tlsCert = value;
+            else if (arg == "--tls-key")
+                tlsKey = value;
+            else if (arg == "--accept-rate")
+                ok = parseRate(value, RateLimit::config.accept_);
+            else if (arg == "--packet-rate")
+                ok = parseRate(value, RateLimit::config.packets_);
+            else if (arg == "--capture")
+                captureFile = value;
+            else if (arg == "--trace")
+                traceFile = value;
+            else if (arg == "--trace-sample")
+                ok = parseInteger(value, 1, UINT32_MAX, traceSample);
+            else
+                ok = false;
+            if (!ok) arg += string(" ") + value;
+        }
+        else
+            ok = parseInteger(arg.c_str(), 1, UINT16_MAX, port);
+
+        if (!ok)
+        {
+            std::cerr << "Invalid argument: " << arg << "\n";
+            usage();
+            return 1;
+        }
+    }
+    if (tlsCert.empty() != tlsKey.empty())
+    {
+        std::cerr << "--tls-cert and --tls-key go together.\n";
+        usage();
+        return 1;
+    }
+
+    // The old process of a hot restart keeps writing until it has handed
+    // off, so the new one appends.
+    initLogger("server.log", true, takeover);
+    if (!traceFile.empty()) Tracing::enable(traceSample, traceFile);
+    if (tlsSelfSign && !Tls::initSelfSigned()) return 1;
+    if (!tlsCert.empty() && !Tls::init(tlsCert, tlsKey)) return 1;
+    if (!captureFile.empty() && !Capture::start(captureFile)) return 1;
+
+    unique_ptr<Server> server =
+        make_unique<Server>(threadCount, policy, spinBudget);
+    if (datagrams) server->enableDatagrams();
+    server->startServer(port, takeover);
+    Capture::stop();
     flushLogs();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "RateLimit.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <sstream>
+
+#include "Logger.hpp"
+
+namespace RateLimit
+{
+    Config config;
+
+    namespace
+    {
+        struct alignas(64) DropShard
+        {
+                std::atomic<uint64_t> drops_[NUM_OF_DROPS];
+                std::atomic<bool>     sampled_; // source_ is being set
+                std::mutex            lock_;
+                std::string           source_;
+        };
+
+        constexpr size_t DROP_SHARDS = 16;
+
+        DropShard            dropShards_[DROP_SHARDS];
+        std::atomic<size_t>  nextDropShard_(0);
+        std::atomic<int64_t> lastReport_(0);
+
+        DropShard &localDropShard()
+        {
+            thread_local DropShard &shard =
+                dropShards_[nextDropShard_.fetch_add(1) % DROP_SHARDS];
+            return shard;
+        }
+
+        // Counts the drops, and returns the shard if the source should be
+        // stored as its example for this interval.
+        DropShard *countDrop(Drop drop, uint64_t count)
+        {
+            auto &shard = localDropShard();
+            shard.drops_[drop].fetch_add(count, std::memory_order_relaxed);
+            if (shard.sampled_.load(std::memory_order_relaxed) ||
+                shard.sampled_.exchange(true))
+                return nullptr;
+            return &shard;
+        }
+
+        uint64_t key(const boost::asio::ip::address &address)
+        {
+            if (address.is_v4()) return address.to_v4().to_uint();
+
+            auto v6 = address.to_v6();
+            if (v6.is_v4_mapped())
+            {
+                return boost::asio::ip::make_address_v4(
+                           boost::asio::ip::v4_mapped, v6)
+                    .to_uint();
+            }
+            auto     bytes = v6.to_bytes();
+            uint64_t prefix;
+            std::memcpy(&prefix, bytes.data(), sizeof(prefix));
+            return prefix;
+        }
+
+        size_t shardOf(uint64_t key, size_t shards)
+        {
+            return ((key * 0x9E3779B97F4A7C15ull) >> 32) % shards;
+        }
+
+        const char *to_string(Drop drop)
+        {
+            switch (drop)
+            {
+                case Drop::CONNECTION:
+                    return "connections refused";
+                case Drop::INVALID_PACKET:
+                    return "invalid packets";
+                case Drop::DISCONNECT:
+                    return "players disconnected";
+                case Drop::THROTTLE:
+                    return "reads throttled";
+                default:
+                    return "unknown";
+            }
+        }
+    } // namespace
+
+    bool Table::allow(const boost::asio::ip::address &address,
+                      const Limit &limit, double cost)
+    {
+        if (limit.rate_ <= 0) return true;
+
+        auto  source = key(address);
+        auto &shard  = shards_[shardOf(source, SHARDS)];
+        auto  now    = Clock::now();
+
+        std::lock_guard<std::mutex> lock(shard.lock_);
+
+        auto it = shard.buckets_.find(source);
+        if (it == shard.buckets_.end())
+        {
+            if (shard.buckets_.size() >= SHARD_CAPACITY)
+            {
+                for (auto bucket = shard.buckets_.begin();
+                     bucket != shard.buckets_.end();)
+                {
+                    if (bucket->second.full(limit, now))
+                        bucket = shard.buckets_.erase(bucket);
+                    else
+                        ++bucket;
+                }
+            }
+            if (shard.buckets_.size() >= SHARD_CAPACITY)
+                return shard.overflow_.consume(limit, cost, now);
+            it = shard.buckets_.emplace(source, TokenBucket()).first;
+        }
+        return it->second.consume(limit, cost, now);
+    }
+
+    size_t Table::size()
+    {
+        size_t total = 0;
+        for (auto &shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.lock_);
+            total += shard.buckets_.size();
+        }
+        return total;
+    }
+
+    void recordDrop(Drop drop, const std::string &source, uint64_t count)
+    {
+        auto shard = countDrop(drop, count);
+        if (shard == nullptr) return;
+        std::lock_guard<std::mutex> lock(shard->lock_);
+        shard->source_ = source;
+    }
+
+    void recordDrop(Drop drop, const boost::asio::ip::address &source,
+                    uint64_t count)
+    {
+        auto shard = countDrop(drop, count);
+        if (shard == nullptr) return;
+        auto text = source.to_string();
+        std::lock_guard<std::mutex> lock(shard->lock_);
+        shard->source_ = std::move(text);
+    }
+
+    void report(Clock::duration interval)
+    {
+        auto now  = Clock::now().time_since_epoch().count();
+        auto last = lastReport_.load(std::memory_order_relaxed);
+        if (now - last < interval.count() ||
+            !lastReport_.compare_exchange_strong(last, now))
+            return;
+        // The first call only starts the interval.
+        if (last == 0) return;
+
+        uint64_t    counts[NUM_OF_DROPS] = {};
+        uint64_t    total                = 0;
+        std::string source;
+        for (auto &shard : dropShards_)
+        {
+            for (uint8_t d = 0; d < NUM_OF_DROPS; ++d)
+            {
+                auto n =
+                    shard.drops_[d].exchange(0, std::memory_order_relaxed);
+                counts[d] += n;
+                total += n;
+            }
+            {
+                std::lock_guard<std::mutex> lock(shard.lock_);
+                if (source.empty()) source = shard.source_;
+                shard.source_.clear();
+            }
+            shard.sampled_.store(false);
+        }
+        if (total == 0) return;
+
+        std::ostringstream summary;
+        summary << "Rate limiting in the last "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       Clock::duration(now - last))
+                       .count()
+                << " ms:";
+        for (uint8_t d = 0; d < NUM_OF_DROPS; ++d)
+        {
+            if (counts[d] != 0)
+                summary << " " << counts[d] << " " << to_string(Drop(d)) << ",";
+        }
+        if (!source.empty()) summary << " e.g. from " << source << ".";
+        auto text = summary.str();
+        if (text.back() == ',') text.back() = '.';
+        LOG_WRN << text;
+    }
+} // namespace RateLimit
@@ -0,0 +1,148 @@
+#ifndef RATE_LIMIT_HPP
+#define RATE_LIMIT_HPP
+
+#include <boost/asio/ip/address.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Token buckets that bound how fast a single source may connect and how
+// fast a single connection may send packets. Checks are a few arithmetic
+// operations; drops are counted rather than logged one by one, and report()
+// logs at most one summary line per interval.
+namespace RateLimit
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Limit
+    {
+            double rate_;  // tokens per second, 0 for no limit
+            double burst_; // bucket size
+    };
+
+    struct Config
+    {
+            Limit accept_  = {20, 40};     // connections per source address
+            Limit packets_ = {2000, 4000}; // packets per connection
+    };
+
+    extern Config config;
+
+    // `rate` per second with bursts of two seconds' worth.
+    inline Limit perSecond(double rate)
+    {
+        return {rate, 2 * rate};
+    }
+
+    // What a packet that does not decode to a valid move or frame costs.
+    constexpr double INVALID_PACKET_COST = 50;
+
+    class TokenBucket
+    {
+        private:
+            double            tokens_;
+            Clock::time_point last_;
+
+            void refill(const Limit &limit, Clock::time_point now)
+            {
+                if (last_ == Clock::time_point())
+                {
+                    tokens_ = limit.burst_;
+                }
+                else
+                {
+                    std::chrono::duration<double> elapsed = now - last_;
+                    tokens_ = std::min(limit.burst_,
+                                       tokens_ + elapsed.count() * limit.rate_);
+                }
+                last_ = now;
+            }
+
+        public:
+            TokenBucket() : tokens_(0), last_()
+            {
+            }
+
+            // Takes `cost` tokens if the bucket holds that many.
+            bool consume(const Limit &limit, double cost = 1,
+                         Clock::time_point now = Clock::now())
+            {
+                if (limit.rate_ <= 0) return true;
+                refill(limit, now);
+                if (tokens_ < cost) return false;
+                tokens_ -= cost;
+                return true;
+            }
+
+            // Takes `cost` tokens even if that leaves the bucket in debt (of
+            // at most one burst), and returns how long until it is out of it.
+            Clock::duration charge(const Limit &limit, double cost,
+                                   Clock::time_point now = Clock::now())
+            {
+                if (limit.rate_ <= 0) return Clock::duration::zero();
+                refill(limit, now);
+                tokens_ = std::max(tokens_ - cost, -limit.burst_);
+                if (tokens_ >= 0) return Clock::duration::zero();
+                return std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(-tokens_ / limit.rate_));
+            }
+
+            // A full bucket is indistinguishable from a new one.
+            bool full(const Limit &limit, Clock::time_point now)
+            {
+                refill(limit, now);
+                return tokens_ >= limit.burst_;
+            }
+    };
+
+    // Buckets keyed by source address (IPv6 by /64 prefix), spread over
+    // independently locked shards. A shard holds a bounded number of
+    // buckets: when it is full, buckets that have refilled are evicted, and
+    // if none has, new sources share the shard's overflow bucket, so that a
+    // flood of spoofed addresses cannot grow the table.
+    class Table
+    {
+        private:
+            struct Shard
+            {
+                    std::mutex                                lock_;
+                    std::unordered_map<uint64_t, TokenBucket> buckets_;
+                    TokenBucket                               overflow_;
+            };
+
+            static constexpr size_t SHARDS         = 64;
+            static constexpr size_t SHARD_CAPACITY = 1024;
+
+            std::array<Shard, SHARDS> shards_;
+
+        public:
+            bool   allow(const boost::asio::ip::address &address,
+                         const Limit &limit, double cost = 1);
+            size_t size();
+    };
+
+    enum Drop : uint8_t
+    {
+        CONNECTION,     // refused at accept
+        INVALID_PACKET, // ignored, charged at INVALID_PACKET_COST
+        DISCONNECT,     // player forfeited its game
+        THROTTLE,       // reads paused on a multiplexed connection
+        NUM_OF_DROPS
+    };
+
+    // Counts drops on per-thread shards without locking. Only the first
+    // drop a shard sees in each summary interval copies its source, which
+    // the summary names as an example.
+    void recordDrop(Drop drop, const std::string &source, uint64_t count = 1);
+    void recordDrop(Drop drop, const boost::asio::ip::address &source,
+                    uint64_t count = 1);
+    // Logs what was dropped since the last summary, if anything, once
+    // `interval` has passed. Cheap enough to call from a polling loop.
+    void report(Clock::duration interval = std::chrono::seconds(1));
+} // namespace RateLimit
+
+#endif
@@ -0,0 +1,472 @@
+#include "Replay.hpp"
+
+#include <iomanip>
+#include <numeric>
+#include <unordered_map>
+
+namespace Replay
+{
+    namespace
+    {
+        constexpr uint64_t MAX_ERRORS_SHOWN = 10;
+        // How much later than recorded a packet may arrive before the
+        // session is given up on.
+        constexpr Clock::duration RESPONSE_TIMEOUT = std::chrono::seconds(5);
+        // Recorded names are cut short so that the name line, with its
+        // challenge, stays well within the server's username limit.
+        constexpr std::size_t MAX_NAME_LENGTH = 64;
+
+        bool matches(const Event &event, Packet packet)
+        {
+            return event.kind_ == Capture::OUT &&
+                   event.payload_.size() == sizeof(Packet) &&
+                   uint8_t(event.payload_[0]) == packet.type_ &&
+                   uint8_t(event.payload_[1]) == packet.data_;
+        }
+
+        string describe(const Event &event)
+        {
+            if (event.payload_.size() != sizeof(Packet))
+                return std::to_string(event.payload_.size()) + " bytes";
+            return GameLib::to_string(
+                Packet(event.payload_[0], event.payload_[1]));
+        }
+
+        string replayName(const Script &script)
+        {
+            return script.userName_.substr(0, MAX_NAME_LENGTH) + "#" +
+                   std::to_string(script.id_);
+        }
+    } // namespace
+
+    Scripts load(const string &path, bool &truncated)
+    {
+        // The latest client action of a session, by record number.
+        struct Action
+        {
+                Script     *script_ = nullptr;
+                std::size_t index_  = 0;
+                uint64_t    record_ = 0;
+        };
+        struct Cause
+        {
+                Script     *script_;
+                std::size_t index_;
+                Action      action_;
+        };
+
+        Capture::Reader                        reader(path);
+        Capture::Record                        record;
+        Scripts                                scripts;
+        std::unordered_map<uint32_t, Script *> byId;
+        std::unordered_map<Script *, Action>   lastAction;
+        vector<Cause>                          causes;
+        uint64_t                               count = 0;
+
+        while (reader.next(record))
+        {
+            ++count;
+            if (record.kind_ == Capture::OPEN)
+            {
+                scripts.push_back(make_unique<Script>(Script{
+                    record.session_, record.payload_, {}, nullptr, nullptr}));
+                auto script = scripts.back().get();
+                script->events_.push_back(
+                    {Capture::OPEN, record.time_, "", nullptr, {}, false});
+                byId[record.session_] = script;
+                lastAction[script]    = {script, 0, count};
+                continue;
+            }
+
+            auto found = byId.find(record.session_);
+            if (found == byId.end()) continue;
+            auto script = found->second;
+            auto index  = script->events_.size();
+
+            switch (record.kind_)
+            {
+                case Capture::PAIR:
+                {
+                    uint64_t opponent;
+                    if (!Capture::decodeVarint(record.payload_, opponent))
+                        break;
+                    auto other = byId.find(static_cast<uint32_t>(opponent));
+                    if (other == byId.end()) break;
+                    script->opponent_        = other->second;
+                    other->second->opponent_ = script;
+                    break;
+                }
+                case Capture::IN:
+                case Capture::HANGUP:
+                    script->events_.push_back({record.kind_, record.time_,
+                                               record.payload_, nullptr, {},
+                                               false});
+                    lastAction[script] = {script, index, count};
+                    break;
+                case Capture::OUT:
+                {
+                    script->events_.push_back({record.kind_, record.time_,
+                                               record.payload_, nullptr, {},
+                                               false});
+                    auto cause = lastAction[script];
+                    if (script->opponent_ != nullptr)
+                    {
+                        auto other = lastAction[script->opponent_];
+                        if (other.record_ > cause.record_) cause = other;
+                    }
+                    causes.push_back({script, index, cause});
+                    break;
+                }
+                default:
+                    // Written by a newer server.
+                    break;
+            }
+        }
+
+        // Only now that no more events are added do their addresses hold.
+        for (auto &cause : causes)
+        {
+            cause.script_->events_[cause.index_].cause_ =
+                &cause.action_.script_->events_[cause.action_.index_];
+        }
+        truncated = reader.truncated();
+        return scripts;
+    }
+
+    string nameLine(const Script &script)
+    {
+        const char challenge[] = {
+            char(GameLib::PacketType::CONN_PACKET),
+            char(GameLib::ConnMsg::CHALLENGE_REQUEST)};
+        auto opponent = script.opponent_ ? script.opponent_ : &script;
+        return replayName(script) + string(challenge, sizeof(challenge)) +
+               replayName(*opponent) + "\n";
+    }
+
+    Runner::Runner(asio::io_service &service, Options options,
+                   Scripts &scripts)
+        : service_(service), options_(std::move(options)), scripts_(scripts),
+          running_(0)
+    {
+        tcp::resolver resolver(service_);
+        auto port = std::to_string(options_.port_);
+        endpoint_ = *resolver.resolve(options_.host_, port).begin();
+        report_.sessions_ = scripts_.size();
+    }
+
+    void Runner::start()
+    {
+        start_ = Clock::now();
+        if (scripts_.empty()) return;
+
+        // The capture may have started long before its first session.
+        uint64_t first = scripts_.front()->events_.front().time_;
+        for (auto &script : scripts_)
+        {
+            auto &events      = script->events_;
+            report_.recorded_ = std::max(report_.recorded_,
+                                         events.back().time_ - first);
+            auto player =
+                std::make_shared<Player>(service_, *this, script.get());
+            script->player_ = player.get();
+            players_.push_back(player);
+            player->start(start_ + scaled(events.front().time_ - first));
+        }
+        running_ = players_.size();
+    }
+
+    Clock::duration Runner::scaled(uint64_t micros) const
+    {
+        if (options_.speed_ <= 0) return Clock::duration::zero();
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::micro>(micros /
+                                                      options_.speed_));
+    }
+
+    void Runner::finished()
+    {
+        if (--running_ == 0) report_.elapsed_ = Clock::now() - start_;
+    }
+
+    Player::Player(asio::io_service &service, Runner &runner, Script *script)
+        : runner_(runner), script_(script), socket_(service), timer_(service),
+          next_(0), writing_(false), timing_(false), hangingUp_(false),
+          done_(false)
+    {
+    }
+
+    void Player::start(Clock::time_point at)
+    {
+        timer_.expires_at(at);
+        timer_.async_wait([self = shared_from_this()](err const &error) {
+            if (!error) self->connect();
+        });
+    }
+
+    void Player::connect()
+    {
+        socket_.async_connect(
+            runner_.endpoint(), [self = shared_from_this()](err const &error) {
+                if (error)
+                    return self->finish(FAILED,
+                                        "cannot connect: " + error.message());
+                err ignored;
+                self->socket_.set_option(tcp::no_delay(true), ignored);
+                self->receive();
+            });
+    }
+
+    void Player::receive()
+    {
+        asio::async_read(
+            socket_, asio::buffer(input_),
+            [self = shared_from_this()](err const &error, std::size_t) {
+                if (self->done_) return;
+                if (error)
+                    return self->finish(FAILED, "connection lost: " +
+                                                    error.message());
+                self->handle(Packet(self->input_[0], self->input_[1]));
+                if (!self->done_) self->receive();
+            });
+    }
+
+    void Player::handle(Packet packet)
+    {
+        if (next_ == 0)
+        {
+            if (packet.type_ != GameLib::PacketType::CONN_PACKET ||
+                packet.data_ != GameLib::ConnMsg::USERNAME_REQUEST)
+                return finish(MISMATCHED,
+                              "expected a username request, received " +
+                                  GameLib::to_string(packet));
+            return sendName();
+        }
+
+        auto &events = script_->events_;
+        if (next_ == events.size())
+        {
+            return finish(MISMATCHED, "received " + GameLib::to_string(packet) +
+                                          " after the end of the session");
+        }
+        if (events[next_].kind_ != Capture::OUT)
+        {
+            return finish(MISMATCHED, "received " + GameLib::to_string(packet) +
+                                          " before its next packet was sent");
+        }
+        if (!matches(events[next_], packet) && !trySwap(packet))
+        {
+            return finish(MISMATCHED, "expected " + describe(events[next_]) +
+                                          ", received " +
+                                          GameLib::to_string(packet));
+        }
+
+        // A swap replaces the script.
+        auto &event  = script_->events_[next_];
+        auto  now    = Clock::now();
+        auto &report = runner_.report();
+        ++report.received_;
+        if (event.cause_ != nullptr && event.cause_->performed_)
+        {
+            report.latencies_.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - event.cause_->performedAt_)
+                    .count());
+        }
+        lastEvent_ = now;
+        ++next_;
+        advance();
+    }
+
+    // The two players of a game challenge each other, so the server may
+    // pick either of them as X. The first packet of the game tells which,
+    // and the players then follow each other's scripts.
+    bool Player::trySwap(Packet packet)
+    {
+        auto opponent = script_->opponent_;
+        if (next_ != 1 || opponent == nullptr || opponent->player_ == nullptr)
+            return false;
+        auto &other = *opponent->player_;
+        if (!other.waitingForGame() || opponent->events_.size() < 2 ||
+            !matches(opponent->events_[1], packet))
+            return false;
+
+        std::swap(script_, other.script_);
+        script_->player_       = this;
+        other.script_->player_ = &other;
+        ++runner_.report().swapped_;
+        return true;
+    }
+
+    void Player::sendName()
+    {
+        auto &open        = script_->events_[0];
+        open.performedAt_ = Clock::now();
+        open.performed_   = true;
+        lastEvent_        = open.performedAt_;
+        ++next_;
+        nameLine_ = nameLine(*script_);
+        write(nameLine_);
+        advance();
+    }
+
+    void Player::advance()
+    {
+        auto &events = script_->events_;
+        while (!done_ && !timing_ && !hangingUp_)
+        {
+            if (next_ == events.size()) return finish(COMPLETED);
+            auto &event = events[next_];
+            auto  due   = lastEvent_ +
+                       runner_.scaled(event.time_ - events[next_ - 1].time_);
+            if (event.kind_ == Capture::OUT)
+            {
+                timer_.expires_at(due + RESPONSE_TIMEOUT);
+                timer_.async_wait([self = shared_from_this(),
+                                   expected = next_](err const &error) {
+                    if (!error && self->next_ == expected)
+                        self->finish(FAILED, "no response");
+                });
+                return;
+            }
+            if (due > Clock::now())
+            {
+                timing_ = true;
+                timer_.expires_at(due);
+                timer_.async_wait(
+                    [self = shared_from_this()](err const &error) {
+                        self->timing_ = false;
+                        if (!error) self->advance();
+                    });
+                return;
+            }
+            perform(event);
+        }
+    }
+
+    void Player::perform(Event &event)
+    {
+        event.performedAt_ = Clock::now();
+        event.performed_   = true;
+        lastEvent_         = event.performedAt_;
+        ++next_;
+        if (event.kind_ == Capture::HANGUP)
+        {
+            // Whatever was sent before hanging up goes out first.
+            hangingUp_ = true;
+            if (!writing_) finish(COMPLETED);
+            return;
+        }
+        ++runner_.report().sent_;
+        write(event.payload_);
+    }
+
+    void Player::write(const string &data)
+    {
+        outbox_ += data;
+        if (!writing_) flush();
+    }
+
+    void Player::flush()
+    {
+        writing_ = true;
+        sending_.swap(outbox_);
+        outbox_.clear();
+        asio::async_write(
+            socket_, asio::buffer(sending_),
+            [self = shared_from_this()](err const &error, std::size_t) {
+                self->writing_ = false;
+                if (self->done_) return;
+                if (error)
+                    return self->finish(FAILED,
+                                        "cannot send: " + error.message());
+                if (!self->outbox_.empty())
+                    self->flush();
+                else if (self->hangingUp_)
+                    self->finish(COMPLETED);
+            });
+    }
+
+    void Player::finish(Outcome outcome, const string &reason)
+    {
+        if (done_) return;
+        done_ = true;
+        err ignored;
+        timer_.cancel(ignored);
+        socket_.close(ignored);
+
+        auto &report = runner_.report();
+        if (outcome == COMPLETED)
+            ++report.completed_;
+        else if (outcome == MISMATCHED)
+            ++report.mismatched_;
+        else
+            ++report.failed_;
+        if (outcome != COMPLETED &&
+            report.mismatched_ + report.failed_ <= MAX_ERRORS_SHOWN)
+        {
+            std::cerr << "Session " << script_->id_ << " ("
+                      << script_->userName_ << "), event " << next_ << ": "
+                      << reason << "\n";
+        }
+        runner_.finished();
+
+        // The opponent cannot play its recorded game on without this one.
+        auto opponent = script_->opponent_;
+        if (outcome != COMPLETED && opponent && opponent->player_)
+            opponent->player_->finish(FAILED, "its opponent failed");
+    }
+
+    void Report::write(std::ostream &out)
+    {
+        auto seconds = [](double micros) { return micros / 1e6; };
+        out << std::fixed << std::setprecision(3);
+        out << "sessions:           " << sessions_ << "\n";
+        out << "  completed:        " << completed_ << "\n";
+        out << "  mismatched:       " << mismatched_ << "\n";
+        out << "  failed:           " << failed_ << "\n";
+        out << "  roles swapped:    " << swapped_ << "\n";
+        out << "packets sent:       " << sent_ << "\n";
+        out << "packets received:   " << received_ << "\n";
+        out << "recorded (s):       " << seconds(recorded_) << "\n";
+        out << "replayed (s):       "
+            << std::chrono::duration<double>(elapsed_).count() << "\n";
+        if (latencies_.empty()) return;
+
+        std::sort(latencies_.begin(), latencies_.end());
+        auto micros = [](uint64_t nanos) { return nanos / 1e3; };
+        auto at     = [&](double quantile) {
+            auto index = static_cast<std::size_t>(quantile *
+                                                  (latencies_.size() - 1));
+            return micros(latencies_[index]);
+        };
+        double mean = std::accumulate(latencies_.begin(), latencies_.end(),
+                                      0.0) /
+                      latencies_.size();
+
+        out << "latency (us):       " << latencies_.size() << " samples\n";
+        out << "  mean:             " << micros(mean) << "\n";
+        out << "  p50:              " << at(0.5) << "\n";
+        out << "  p90:              " << at(0.9) << "\n";
+        out << "  p99:              " << at(0.99) << "\n";
+        out << "  p99.9:            " << at(0.999) << "\n";
+        out << "  max:              " << micros(latencies_.back()) << "\n";
+
+        // Bucket b counts latencies below 2^b microseconds.
+        vector<uint64_t> buckets;
+        for (auto nanos : latencies_)
+        {
+            std::size_t bucket = 0;
+            while ((uint64_t(1) << bucket) * 1000 <= nanos) ++bucket;
+            if (bucket >= buckets.size()) buckets.resize(bucket + 1);
+            ++buckets[bucket];
+        }
+        out << "histogram (us):\n";
+        for (std::size_t b = 0; b < buckets.size(); ++b)
+        {
+            if (buckets[b] == 0) continue;
+            out << "  < " << std::left << std::setw(16)
+                << (std::to_string(uint64_t(1) << b) + ":") << std::right
+                << buckets[b] << "\n";
+        }
+    }
+} // namespace Replay
@@ -0,0 +1,177 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <chrono>
+#include <ostream>
+
+#include "Capture.hpp"
+#include "Game.hpp"
+
+// Re-drives the sessions of a capture file against a server. Each session
+// gets its own connection, which sends what the player sent and checks that
+// the server answers with what it answered then.
+//
+// Sessions are replayed causally: a packet the player sent is only sent
+// once every packet the player had received before it has arrived, after
+// the player's recorded think time divided by the speed. The recorded
+// pairings are reproduced with challenges, so the same two sessions play
+// each other again. The latency of a packet from the server is measured from
+// the latest thing either player of its game did before it in the capture:
+// sending a name, a move, or hanging up.
+namespace Replay
+{
+    using Clock = std::chrono::steady_clock;
+    using GameLib::Packet;
+
+    class Player;
+
+    struct Event
+    {
+            Capture::Kind     kind_; // OPEN, IN, OUT or HANGUP
+            uint64_t          time_; // microseconds since the capture started
+            string            payload_;
+            // OUT only: the client action it is timed from, if any.
+            Event            *cause_;
+            // Set once the action has been replayed.
+            Clock::time_point performedAt_;
+            bool              performed_;
+    };
+
+    // One recorded session. Its first event is OPEN.
+    struct Script
+    {
+            uint32_t      id_;
+            string        userName_;
+            vector<Event> events_;
+            Script       *opponent_; // nullptr if it never got a game
+            Player       *player_;   // the connection replaying it
+    };
+
+    using Scripts = vector<unique_ptr<Script>>;
+
+    // Reads a capture file, in the order its sessions were opened. Throws
+    // std::runtime_error if it is not a capture file.
+    Scripts load(const string &path, bool &truncated);
+
+    struct Options
+    {
+            string   host_  = "127.0.0.1";
+            uint16_t port_  = 9000;
+            double   speed_ = 1; // 0 replays as fast as possible
+    };
+
+    struct Report
+    {
+            uint64_t         sessions_   = 0;
+            uint64_t         completed_  = 0;
+            uint64_t         mismatched_ = 0;
+            uint64_t         failed_     = 0;
+            uint64_t         swapped_    = 0;
+            uint64_t         sent_       = 0;
+            uint64_t         received_   = 0;
+            uint64_t         recorded_   = 0; // microseconds
+            Clock::duration  elapsed_{};
+            vector<uint64_t> latencies_; // nanoseconds
+
+            bool passed() const
+            {
+                return mismatched_ == 0 && failed_ == 0;
+            }
+
+            // Latency percentiles and a histogram with power of two buckets.
+            void write(std::ostream &out);
+    };
+
+    // Replays every script on one io_service.
+    class Runner
+    {
+        private:
+            asio::io_service               &service_;
+            Options                         options_;
+            Scripts                        &scripts_;
+            tcp::endpoint                   endpoint_;
+            vector<std::shared_ptr<Player>> players_;
+            Report                          report_;
+            Clock::time_point               start_;
+            std::size_t                     running_;
+
+        public:
+            Runner(asio::io_service &service, Options options,
+                   Scripts &scripts);
+
+            // Schedules every session; run the io_service to replay them.
+            void start();
+
+            // A recorded gap at the replay speed.
+            Clock::duration scaled(uint64_t micros) const;
+
+            const tcp::endpoint &endpoint() const
+            {
+                return endpoint_;
+            }
+
+            Report &report()
+            {
+                return report_;
+            }
+
+            void finished();
+    };
+
+    class Player : public std::enable_shared_from_this<Player>
+    {
+        public:
+            enum Outcome
+            {
+                COMPLETED,
+                MISMATCHED,
+                FAILED
+            };
+
+        private:
+            Runner                        &runner_;
+            Script                        *script_;
+            tcp::socket                    socket_;
+            asio::steady_timer             timer_;
+            std::size_t                    next_; // the event to replay next
+            Clock::time_point              lastEvent_;
+            array<uint8_t, sizeof(Packet)> input_;
+            string                         nameLine_;
+            string                         outbox_; // queued behind a write
+            string                         sending_;
+            bool                           writing_;
+            bool                           timing_; // waiting out think time
+            bool                           hangingUp_;
+            bool                           done_;
+
+            void connect();
+            void receive();
+            void handle(Packet packet);
+            bool trySwap(Packet packet);
+            void sendName();
+            void advance();
+            void perform(Event &event);
+            void write(const string &data);
+            void flush();
+            void finish(Outcome outcome, const string &reason = "");
+
+        public:
+            Player(asio::io_service &service, Runner &runner, Script *script);
+
+            void start(Clock::time_point at);
+
+            // True until the player has received anything after sending
+            // its name.
+            bool waitingForGame() const
+            {
+                return next_ == 1 && !done_;
+            }
+    };
+
+    // The name a session uses in the replay: unique, and followed by a
+    // challenge to its recorded opponent. Sessions that never got a game
+    // challenge themselves, which keeps them out of other games.
+    string nameLine(const Script &script);
+} // namespace Replay
+
+#endif
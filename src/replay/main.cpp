@@ -0,0 +1,126 @@
+#include "Replay.hpp"
+
+#include <sys/resource.h>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+
+using namespace Replay;
+
+namespace
+{
+    void usage()
+    {
+        std::cerr << "Usage: replay [--host ADDRESS] [--port N] "
+                     "[--speed FACTOR|max] FILE\n"
+                     "Exits with 2 if a session did not replay as "
+                     "recorded.\n";
+    }
+
+    bool parsePort(const string &text, uint16_t &port)
+    {
+        if (!std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+        char *end = nullptr;
+        errno     = 0;
+        auto parsed = std::strtoul(text.c_str(), &end, 10);
+        if (*end != '\0' || errno != 0 || parsed == 0 || parsed > UINT16_MAX)
+            return false;
+        port = static_cast<uint16_t>(parsed);
+        return true;
+    }
+
+    // A positive factor, or "max" to replay as fast as possible.
+    bool parseSpeed(const string &text, double &speed)
+    {
+        if (text == "max")
+        {
+            speed = 0;
+            return true;
+        }
+        char *end = nullptr;
+        errno     = 0;
+        auto parsed = std::strtod(text.c_str(), &end);
+        if (end == text.c_str() || *end != '\0' || errno != 0 ||
+            !std::isfinite(parsed) || parsed <= 0)
+            return false;
+        speed = parsed;
+        return true;
+    }
+
+    // Every session holds a connection for as long as it is replayed.
+    void raiseFileLimit()
+    {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    string  path;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            path = arg;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            usage();
+            return 1;
+        }
+
+        string value = argv[++i];
+        bool   ok    = true;
+        if (arg == "--host")
+            options.host_ = value;
+        else if (arg == "--port")
+            ok = parsePort(value, options.port_);
+        else if (arg == "--speed")
+            ok = parseSpeed(value, options.speed_);
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            std::cerr << "Invalid argument: " << arg << " " << value << "\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (path.empty())
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        bool truncated = false;
+        auto scripts   = load(path, truncated);
+        if (truncated)
+            std::cerr << "The capture ends with a partial record.\n";
+
+        raiseFileLimit();
+        asio::io_service service;
+        Runner           runner(service, options, scripts);
+        runner.start();
+        service.run();
+
+        runner.report().write(std::cout);
+        return runner.report().passed() ? 0 : 2;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
@@ -0,0 +1,202 @@
+#include "Tracer.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Tracing
+{
+    std::atomic<bool> enabled(false);
+
+    namespace
+    {
+        struct TracedEvent
+        {
+                Event    event_;
+                uint32_t threadId_;
+        };
+
+        std::atomic<uint32_t> sampleEvery_(1);
+        std::atomic<uint64_t> moveCounter_(0);
+        std::atomic<uint64_t> nextMoveId_(1);
+        std::atomic<size_t>   bufferCapacity_(1 << 16);
+
+        // Buffers outlive their threads so that events recorded by a worker
+        // that has exited are still exported.
+        std::mutex                                 registryLock_;
+        std::vector<std::unique_ptr<ThreadBuffer>> registry_;
+        std::string                                outputPath_;
+        uint32_t                                   dumps_ = 0;
+
+        thread_local ThreadBuffer *localBuffer_ = nullptr;
+
+        const char *spanName(Stage stage)
+        {
+            switch (stage)
+            {
+                case Stage::READ_COMPLETE:
+                    return "io_dispatch";
+                case Stage::HANDLER_DISPATCH:
+                    return "update_board";
+                case Stage::BOARD_UPDATE:
+                    return "issue_send";
+                case Stage::SEND_ISSUED:
+                    return "async_write";
+                default:
+                    return "unknown";
+            }
+        }
+
+        void writeAsyncEvent(std::ofstream &out, bool &first, const char *name,
+                             char phase, uint64_t moveId, uint64_t timestamp,
+                             uint64_t origin, uint32_t threadId)
+        {
+            out << (first ? "\n" : ",\n") << "  {\"name\": \"" << name
+                << "\", \"cat\": \"move\", \"ph\": \"" << phase
+                << "\", \"id\": " << moveId
+                << ", \"ts\": " << (timestamp - origin) / 1000.0
+                << ", \"pid\": 1, \"tid\": " << threadId << "}";
+            first = false;
+        }
+    } // namespace
+
+    ThreadBuffer::ThreadBuffer(size_t capacity, uint32_t threadId,
+                               uint32_t osThreadId)
+        : events_(new Event[capacity]), capacity_(capacity), head_(0),
+          tail_(0), dropped_(0), threadId_(threadId), osThreadId_(osThreadId)
+    {
+    }
+
+    void enable(uint32_t sampleEvery, std::string outputPath,
+                size_t bufferCapacity)
+    {
+        {
+            const std::lock_guard<std::mutex> lock(registryLock_);
+            outputPath_ = std::move(outputPath);
+        }
+        sampleEvery_.store(std::max(sampleEvery, 1u));
+        bufferCapacity_.store(bufferCapacity);
+        enabled.store(true);
+    }
+
+    void disable()
+    {
+        enabled.store(false);
+    }
+
+    uint64_t sampleMove()
+    {
+        auto count = moveCounter_.fetch_add(1, std::memory_order_relaxed);
+        if (count % sampleEvery_.load(std::memory_order_relaxed) != 0)
+            return 0;
+        return nextMoveId_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ThreadBuffer &localBuffer()
+    {
+        if (localBuffer_ == nullptr)
+        {
+            const std::lock_guard<std::mutex> lock(registryLock_);
+            registry_.push_back(std::make_unique<ThreadBuffer>(
+                bufferCapacity_.load(), static_cast<uint32_t>(registry_.size()),
+                static_cast<uint32_t>(::syscall(SYS_gettid))));
+            localBuffer_ = registry_.back().get();
+        }
+        return *localBuffer_;
+    }
+
+    bool dump()
+    {
+        std::string path;
+        {
+            const std::lock_guard<std::mutex> lock(registryLock_);
+            if (outputPath_.empty()) return false;
+            path = outputPath_ + "." + std::to_string(++dumps_);
+        }
+        return exportChromeTrace(path);
+    }
+
+    bool exportChromeTrace(const std::string &path)
+    {
+        std::ofstream out(path);
+        if (!out.good()) return false;
+
+        std::vector<TracedEvent> events;
+        std::vector<std::pair<uint32_t, uint32_t>> threads;
+        uint64_t                                   dropped = 0;
+        {
+            const std::lock_guard<std::mutex> lock(registryLock_);
+            for (auto const &buffer : registry_)
+            {
+                auto threadId = buffer->threadId();
+                buffer->drain([&](Event const &event) {
+                    events.push_back({event, threadId});
+                });
+                threads.emplace_back(threadId, buffer->osThreadId());
+                dropped += buffer->takeDropped();
+            }
+        }
+
+        std::sort(events.begin(), events.end(),
+                  [](TracedEvent const &a, TracedEvent const &b) {
+                      if (a.event_.moveId_ != b.event_.moveId_)
+                          return a.event_.moveId_ < b.event_.moveId_;
+                      return a.event_.timestamp_ < b.event_.timestamp_;
+                  });
+
+        uint64_t origin = UINT64_MAX;
+        for (auto const &e : events)
+            origin = std::min(origin, e.event_.timestamp_);
+
+        bool first = true;
+        out << "{\"displayTimeUnit\": \"ns\", \"otherData\": "
+               "{\"dropped_events\": "
+            << dropped << "}, \"traceEvents\": [";
+
+        for (auto const &thread : threads)
+        {
+            out << (first ? "\n" : ",\n")
+                << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                   "\"tid\": "
+                << thread.first << ", \"args\": {\"name\": \"worker-"
+                << thread.second << "\"}}";
+            first = false;
+        }
+
+        // Each move becomes an async slice, with one nested slice per pair
+        // of consecutive stages. Stages of a move may run on different
+        // threads, so async events are used rather than complete events.
+        for (size_t begin = 0; begin < events.size();)
+        {
+            size_t end = begin;
+            while (end < events.size() &&
+                   events[end].event_.moveId_ == events[begin].event_.moveId_)
+                ++end;
+
+            auto const &head   = events[begin];
+            auto const  moveId = head.event_.moveId_;
+            writeAsyncEvent(out, first, "move", 'b', moveId,
+                            head.event_.timestamp_, origin, head.threadId_);
+            for (size_t i = begin; i + 1 < end; ++i)
+            {
+                auto const &from = events[i];
+                auto const &to   = events[i + 1];
+                auto        name = spanName(from.event_.stage_);
+                writeAsyncEvent(out, first, name, 'b', moveId,
+                                from.event_.timestamp_, origin,
+                                from.threadId_);
+                writeAsyncEvent(out, first, name, 'e', moveId,
+                                to.event_.timestamp_, origin, to.threadId_);
+            }
+            auto const &tail = events[end - 1];
+            writeAsyncEvent(out, first, "move", 'e', moveId,
+                            tail.event_.timestamp_, origin, tail.threadId_);
+            begin = end;
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+} // namespace Tracing
@@ -0,0 +1,134 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Tracing
+{
+    // Stages a move goes through on the server, in order.
+    enum Stage : uint8_t
+    {
+        READ_COMPLETE,
+        HANDLER_DISPATCH,
+        BOARD_UPDATE,
+        SEND_ISSUED,
+        SEND_COMPLETE,
+        NUM_OF_STAGES
+    };
+
+    struct Event
+    {
+            uint64_t moveId_;
+            uint64_t timestamp_; // steady_clock, ns
+            Stage    stage_;
+    };
+
+    // Fixed-size ring of events, written by the thread that owns it and
+    // drained by dump(). Events are dropped (and counted) while it is full.
+    class ThreadBuffer
+    {
+        private:
+            std::unique_ptr<Event[]> events_;
+            size_t                   capacity_;
+            std::atomic<size_t>      head_; // events pushed
+            std::atomic<size_t>      tail_; // events drained
+            std::atomic<uint64_t>    dropped_;
+            uint32_t                 threadId_;
+            uint32_t                 osThreadId_;
+
+        public:
+            ThreadBuffer(size_t capacity, uint32_t threadId,
+                         uint32_t osThreadId);
+
+            void push(uint64_t moveId, Stage stage, uint64_t timestamp)
+            {
+                auto head = head_.load(std::memory_order_relaxed);
+                if (head - tail_.load(std::memory_order_acquire) == capacity_)
+                {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                events_[head % capacity_] = Event{moveId, timestamp, stage};
+                head_.store(head + 1, std::memory_order_release);
+            }
+
+            // Moves the buffered events to `out` and frees their slots.
+            // Only one thread may drain at a time.
+            template <class Out> void drain(Out &&out)
+            {
+                auto tail = tail_.load(std::memory_order_relaxed);
+                auto head = head_.load(std::memory_order_acquire);
+                for (; tail != head; ++tail) out(events_[tail % capacity_]);
+                tail_.store(tail, std::memory_order_release);
+            }
+
+            // Events dropped since the last call.
+            uint64_t takeDropped()
+            {
+                return dropped_.exchange(0, std::memory_order_relaxed);
+            }
+
+            uint32_t threadId() const
+            {
+                return threadId_;
+            }
+
+            uint32_t osThreadId() const
+            {
+                return osThreadId_;
+            }
+    };
+
+    extern std::atomic<bool> enabled;
+
+    // Starts tracing one in every `sampleEvery` moves. Each thread that
+    // records an event gets a buffer of `bufferCapacity` events.
+    void enable(uint32_t sampleEvery, std::string outputPath,
+                size_t bufferCapacity = 1 << 16);
+    void disable();
+
+    // Writes the events buffered since the last dump as Chrome/Perfetto
+    // trace-event JSON to `<output path>.<n>`, where n counts dumps from 1,
+    // and frees their space. Returns false if the file cannot be opened.
+    bool dump();
+    bool exportChromeTrace(const std::string &path);
+
+    uint64_t      sampleMove();
+    ThreadBuffer &localBuffer();
+
+    inline uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Returns a non-zero id if this move should be traced. When tracing is
+    // disabled this is a single relaxed load and branch.
+    inline uint64_t beginMove()
+    {
+        if (__builtin_expect(!enabled.load(std::memory_order_relaxed), 1))
+            return 0;
+        return sampleMove();
+    }
+
+    inline void record(uint64_t moveId, Stage stage)
+    {
+        if (__builtin_expect(moveId == 0, 1)) return;
+        localBuffer().push(moveId, stage, now());
+    }
+
+    // Records a stage reached at `timestamp`, taken earlier with now(). A
+    // zero timestamp, i.e. one taken before tracing was enabled, is skipped.
+    inline void record(uint64_t moveId, Stage stage, uint64_t timestamp)
+    {
+        if (__builtin_expect(moveId == 0, 1) || timestamp == 0) return;
+        localBuffer().push(moveId, stage, timestamp);
+    }
+} // namespace Tracing
+
+#endif